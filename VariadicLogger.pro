@@ -4,6 +4,10 @@ CONFIG -= qt
 
 SUBDIRS = \
     project \
-    test
+    test \
+    test_level
 
 test.depends = project
+
+# library built with a raised VL_ACTIVE_LEVEL
+test_level.file = test/level/test_level.pro
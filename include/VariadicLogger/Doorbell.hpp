@@ -0,0 +1,155 @@
+/*
+ *  Copyright (c) 2013, Vitalii Turinskyi
+ *  All rights reserved.
+ *
+ *  Distributed under the Boost Software License, Version 1.0. (See accompanying
+ *  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#define VL_DOORBELL_FUTEX
+#else
+#include <mutex>
+#include <condition_variable>
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <emmintrin.h>
+#endif
+
+namespace vl
+{
+    /*
+     * Wakes a single consumer thread when producers publish work. The consumer
+     * spins for a while before it parks (on a futex on Linux, on a condition
+     * variable elsewhere), and producers only pay for a wakeup when it is
+     * actually parked; while it is awake ringing is a single atomic load.
+     * This relies on the consumer checking for work after it announces that
+     * it parks, so producers must publish with sequentially consistent atomics
+     * and the consumer's [ready] check must read them the same way.
+     */
+    class Doorbell
+    {
+    public:
+        // [spin_count] checks for work before parking, no spinning on a single core
+        explicit Doorbell(unsigned int spin_count = 512)
+            : state_(awake)
+            , spin_count_(std::thread::hardware_concurrency() > 1 ? spin_count : 0)
+#ifndef VL_DOORBELL_FUTEX
+            , lock_()
+            , cond_()
+#endif
+        { }
+
+        // producer side, after publishing the work
+        void ring()
+        {
+            if (state_.load() != parked)
+                return;
+
+            // only one of the producers that saw the consumer parked wakes it
+            if (state_.exchange(awake) == parked)
+                wake();
+        }
+
+        // consumer side; returns [ready]() once it is true or the timeout expires
+        template <typename Ready, typename Rel, typename Period>
+        bool wait_for(Ready ready, const std::chrono::duration<Rel, Period>& timeout)
+        {
+            for (unsigned int i = 0; i < spin_count_; ++i)
+            {
+                if (ready())
+                    return true;
+                cpu_relax();
+            }
+
+            // a producer either sees the consumer parked or its work is seen below
+            state_.store(parked);
+            if (ready())
+            {
+                state_.store(awake);
+                return true;
+            }
+
+            auto deadline = std::chrono::steady_clock::now() + timeout;
+            while (state_.load() == parked)
+            {
+                auto now = std::chrono::steady_clock::now();
+                if (now >= deadline)
+                    break;
+                park(std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now));
+            }
+
+            state_.store(awake);
+            return ready();
+        }
+
+    private:
+        Doorbell(const Doorbell&);
+        Doorbell& operator=(const Doorbell&);
+
+        enum { awake = 0, parked = 1 };
+
+        static void cpu_relax()
+        {
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+            __builtin_ia32_pause();
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+            _mm_pause();
+#endif
+        }
+
+#ifdef VL_DOORBELL_FUTEX
+
+        static_assert(sizeof(std::atomic<int>) == sizeof(int), "futex needs a plain int");
+
+        int* futex_word() { return reinterpret_cast<int*>(&state_); }
+
+        // returns at once if a producer has already woken the consumer
+        void park(std::chrono::nanoseconds timeout)
+        {
+            timespec ts;
+            ts.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+            ts.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+            syscall(SYS_futex, futex_word(), FUTEX_WAIT_PRIVATE, static_cast<int>(parked), &ts, nullptr, 0);
+        }
+
+        void wake()
+        {
+            syscall(SYS_futex, futex_word(), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+        }
+
+#else
+
+        // the state is checked under the lock, which wake() takes after changing it
+        void park(std::chrono::nanoseconds timeout)
+        {
+            std::unique_lock<std::mutex> lk(lock_);
+            cond_.wait_for(lk, timeout, [&]{ return state_.load() != parked; });
+        }
+
+        void wake()
+        {
+            std::lock_guard<std::mutex> lk(lock_);
+            cond_.notify_one();
+        }
+
+#endif
+
+        std::atomic<int> state_;
+        unsigned int spin_count_;
+#ifndef VL_DOORBELL_FUTEX
+        std::mutex lock_;
+        std::condition_variable cond_;
+#endif
+    };
+}
@@ -12,11 +12,27 @@
 #include <iostream>
 #include <ostream>
 #include <string>
+#include <memory>
 #include <stdexcept>
 #include <sstream>
 #include <assert.h>
 
 
+// values of vl::LogLevel for use in preprocessor conditions
+#define VL_LEVEL_DEBUG    0
+#define VL_LEVEL_INFO     1
+#define VL_LEVEL_WARNING  2
+#define VL_LEVEL_ERROR    3
+#define VL_LEVEL_CRITICAL 4
+#define VL_LEVEL_OFF      5
+
+// messages below this level are compiled out, define it for the whole project
+// (library included), e. g. -DVL_ACTIVE_LEVEL=VL_LEVEL_WARNING
+#ifndef VL_ACTIVE_LEVEL
+    #define VL_ACTIVE_LEVEL VL_LEVEL_DEBUG
+#endif
+
+
 namespace vl
 {
     // forward declarations
@@ -25,7 +41,11 @@ namespace vl
         template <typename T>
         class LogWorker;
         struct Work;
-        void queue_work(Work&& work);
+        // queued messages are recycled, the writer returns them once written
+        Work* acquire_work();
+        void queue_work(Work* work);
+        struct SinkSetHandle;
+        unsigned int sink_slot(SinkSetHandle& handle);
     }
 
 
@@ -33,12 +53,12 @@ namespace vl
 
     enum LogLevel
     {
-        debug       = 0,
-        info        = 1,
-        warning     = 2,
-        error       = 3,
-        critical    = 4,
-        nologging   = 5
+        debug       = VL_LEVEL_DEBUG,
+        info        = VL_LEVEL_INFO,
+        warning     = VL_LEVEL_WARNING,
+        error       = VL_LEVEL_ERROR,
+        critical    = VL_LEVEL_CRITICAL,
+        nologging   = VL_LEVEL_OFF
     };
 
     // return LL_NoLogging on unknown strings
@@ -53,10 +73,27 @@ namespace vl
         noflush      = (1u << 3),
         nologgername = (1u << 4),
         nothreadid   = (1u << 5),
-        nospace      = (1u << 6)
+        nospace      = (1u << 6),
+        deferred     = (1u << 7)   // vl::Logger only: VL_FMT messages are formatted by the writer thread
     };
 
 
+    namespace d_
+    {
+        // returned by the stream accessors of levels compiled out with
+        // VL_ACTIVE_LEVEL, discards everything without touching the logger
+        class NullWorker
+        {
+        public:
+            template <typename A>
+            NullWorker& operator<<(const A&) { return *this; }
+
+            NullWorker& operator<<(std::ostream& (*)(std::ostream&)) { return *this; }
+            NullWorker& operator<<(std::ios_base& (*)(std::ios_base&)) { return *this; }
+        };
+    }
+
+
     class delegate;
     class immediate;
 
@@ -131,22 +168,53 @@ namespace vl
 
         void clear_streams();
 
+        // true when a message of [level] would be written to any stream,
+        // checked before any formatting is done
+        bool should_log(LogLevel level) const { return level >= VL_ACTIVE_LEVEL && level >= min_level_; }
+
         // modify logger options
 
         void set(LogOpts opt);
         void unset(LogOpts opt);
         void reset();
 
+        // layout of messages, e. g. "%Y-%m-%d %H:%M:%S.%f %l [%n] %t %v", compiled once;
+        // replaces the timestamp, logger name, thread id and log level options,
+        // an empty pattern restores the default layout; returns false on invalid patterns
+        bool set_pattern(const std::string& pattern);
+
 
         // returns temporary object for atomic write
 
         d_::LogWorker<T> log(LogLevel level);
 
-        d_::LogWorker<T> debug();
-        d_::LogWorker<T> info();
-        d_::LogWorker<T> warning();
-        d_::LogWorker<T> error();
-        d_::LogWorker<T> critical();
+        // levels below VL_ACTIVE_LEVEL return a d_::NullWorker instead
+
+#if VL_ACTIVE_LEVEL <= VL_LEVEL_DEBUG
+        d_::LogWorker<T> debug() { return log(vl::debug); }
+#else
+        d_::NullWorker debug() { return d_::NullWorker(); }
+#endif
+#if VL_ACTIVE_LEVEL <= VL_LEVEL_INFO
+        d_::LogWorker<T> info() { return log(vl::info); }
+#else
+        d_::NullWorker info() { return d_::NullWorker(); }
+#endif
+#if VL_ACTIVE_LEVEL <= VL_LEVEL_WARNING
+        d_::LogWorker<T> warning() { return log(vl::warning); }
+#else
+        d_::NullWorker warning() { return d_::NullWorker(); }
+#endif
+#if VL_ACTIVE_LEVEL <= VL_LEVEL_ERROR
+        d_::LogWorker<T> error() { return log(vl::error); }
+#else
+        d_::NullWorker error() { return d_::NullWorker(); }
+#endif
+#if VL_ACTIVE_LEVEL <= VL_LEVEL_CRITICAL
+        d_::LogWorker<T> critical() { return log(vl::critical); }
+#else
+        d_::NullWorker critical() { return d_::NullWorker(); }
+#endif
 
         // type-safe veriadic logging functions
 
@@ -156,13 +224,24 @@ namespace vl
         void log(LogLevel level, const std::string& fmt, Args&&... args)
         {
             assert(level != nologging);
+            if (!should_log(level))
+                return;
+
             try
             {
-                std::string msg;
-                add_prelude(msg, level);
-                safe_sprintf(msg, fmt, std::forward<Args>(args)...);
-                add_epilog(msg, level);
-                write_to_streams(level, std::move(msg));
+                char inline_body[inline_message_size];
+                d_::FixedBuffer body(inline_body, sizeof(inline_body));
+                safe_sprintf(body, fmt, args...);
+                if (!body.truncated())
+                    write_message(level, body.data(), body.size());
+                else
+                {
+                    // too long for the stack, so format again straight into the message
+                    std::string msg;
+                    start_message(msg, level, body.total_size());
+                    safe_sprintf(msg, fmt, args...);
+                    finish_message(msg, level);
+                }
             }
             catch (const std::exception& ex)
             {
@@ -170,34 +249,72 @@ namespace vl
             }
         }
 
-        template <typename... Args>
-        void debug(const std::string& fmt, Args&&... args)
+#ifdef VL_CONSTEXPR_SUPPORTED
+
+        // format strings wrapped in VL_FMT, parsed and checked against the argument
+        // types during compilation, so there are no format errors to handle here
+        template <typename S, typename... Args>
+        void log(LogLevel level, const d_::StaticFormat<S>& fmt, Args&&... args)
         {
-            log(debug, fmt, std::forward<Args>(args)...);
+            assert(level != nologging);
+            if (!should_log(level))
+                return;
+
+            if (deferred_ && log_deferred(level, fmt, d_::capturable<Args...>(), args...))
+                return;
+
+            char inline_body[inline_message_size];
+            d_::FixedBuffer body(inline_body, sizeof(inline_body));
+            safe_sprintf(body, fmt, args...);
+            if (!body.truncated())
+                write_message(level, body.data(), body.size());
+            else
+            {
+                // too long for the stack, so format again straight into the message
+                std::string msg;
+                start_message(msg, level, body.total_size());
+                safe_sprintf(msg, fmt, args...);
+                finish_message(msg, level);
+            }
         }
 
-        template <typename... Args>
-        void info(const std::string& fmt, Args&&... args)
+#endif
+
+        // [F] is either std::string or VL_FMT format
+
+        template <typename F, typename... Args>
+        void debug(const F& fmt, Args&&... args)
         {
-            log(info, fmt, std::forward<Args>(args)...);
+            if (VL_ACTIVE_LEVEL <= VL_LEVEL_DEBUG)
+                log(vl::debug, fmt, std::forward<Args>(args)...);
         }
 
-        template <typename... Args>
-        void warning(const std::string& fmt, Args&&... args)
+        template <typename F, typename... Args>
+        void info(const F& fmt, Args&&... args)
         {
-            log(warning, fmt, std::forward<Args>(args)...);
+            if (VL_ACTIVE_LEVEL <= VL_LEVEL_INFO)
+                log(vl::info, fmt, std::forward<Args>(args)...);
         }
 
-        template <typename... Args>
-        void error(const std::string& fmt, Args&&... args)
+        template <typename F, typename... Args>
+        void warning(const F& fmt, Args&&... args)
         {
-            log(error, fmt, std::forward<Args>(args)...);
+            if (VL_ACTIVE_LEVEL <= VL_LEVEL_WARNING)
+                log(vl::warning, fmt, std::forward<Args>(args)...);
         }
 
-        template <typename... Args>
-        void critical(const std::string& fmt, Args&&... args)
+        template <typename F, typename... Args>
+        void error(const F& fmt, Args&&... args)
         {
-            log(critical, fmt, std::forward<Args>(args)...);
+            if (VL_ACTIVE_LEVEL <= VL_LEVEL_ERROR)
+                log(vl::error, fmt, std::forward<Args>(args)...);
+        }
+
+        template <typename F, typename... Args>
+        void critical(const F& fmt, Args&&... args)
+        {
+            if (VL_ACTIVE_LEVEL <= VL_LEVEL_CRITICAL)
+                log(vl::critical, fmt, std::forward<Args>(args)...);
         }
 
 #else  // limit to 3 arguments
@@ -205,13 +322,24 @@ namespace vl
         inline void log(LogLevel level, const std::string& fmt)
         {
             assert(level != nologging);
+            if (!should_log(level))
+                return;
+
             try
             {
-                std::string msg;
-                add_prelude(msg, level);
-                safe_sprintf(msg, fmt);
-                add_epilog(msg, level);
-                write_to_streams(level, std::move(msg));
+                char inline_body[inline_message_size];
+                d_::FixedBuffer body(inline_body, sizeof(inline_body));
+                safe_sprintf(body, fmt);
+                if (!body.truncated())
+                    write_message(level, body.data(), body.size());
+                else
+                {
+                    // too long for the stack, so format again straight into the message
+                    std::string msg;
+                    start_message(msg, level, body.total_size());
+                    safe_sprintf(msg, fmt);
+                    finish_message(msg, level);
+                }
             }
             catch (const std::exception& ex)
             {
@@ -223,13 +351,24 @@ namespace vl
         void log(LogLevel level, const std::string& fmt, A0&& arg0)
         {
             assert(level != nologging);
+            if (!should_log(level))
+                return;
+
             try
             {
-                std::string msg;
-                add_prelude(msg, level);
-                safe_sprintf(msg, fmt, std::forward<A0>(arg0));
-                add_epilog(msg, level);
-                write_to_streams(level, std::move(msg));
+                char inline_body[inline_message_size];
+                d_::FixedBuffer body(inline_body, sizeof(inline_body));
+                safe_sprintf(body, fmt, arg0);
+                if (!body.truncated())
+                    write_message(level, body.data(), body.size());
+                else
+                {
+                    // too long for the stack, so format again straight into the message
+                    std::string msg;
+                    start_message(msg, level, body.total_size());
+                    safe_sprintf(msg, fmt, arg0);
+                    finish_message(msg, level);
+                }
             }
             catch (const std::exception& ex)
             {
@@ -241,13 +380,24 @@ namespace vl
         void log(LogLevel level, const std::string& fmt, A0&& arg0, A1&& arg1)
         {
             assert(level != nologging);
+            if (!should_log(level))
+                return;
+
             try
             {
-                std::string msg;
-                add_prelude(msg, level);
-                safe_sprintf(msg, fmt, std::forward<A0>(arg0), std::forward<A1>(arg1));
-                add_epilog(msg, level);
-                write_to_streams(level, std::move(msg));
+                char inline_body[inline_message_size];
+                d_::FixedBuffer body(inline_body, sizeof(inline_body));
+                safe_sprintf(body, fmt, arg0, arg1);
+                if (!body.truncated())
+                    write_message(level, body.data(), body.size());
+                else
+                {
+                    // too long for the stack, so format again straight into the message
+                    std::string msg;
+                    start_message(msg, level, body.total_size());
+                    safe_sprintf(msg, fmt, arg0, arg1);
+                    finish_message(msg, level);
+                }
             }
             catch (const std::exception& ex)
             {
@@ -259,13 +409,24 @@ namespace vl
         void log(LogLevel level, const std::string& fmt, A0&& arg0, A1&& arg1, A2&& arg2)
         {
             assert(level != nologging);
+            if (!should_log(level))
+                return;
+
             try
             {
-                std::string msg;
-                add_prelude(msg, level);
-                safe_sprintf(msg, fmt, std::forward<A0>(arg0), std::forward<A1>(arg1), std::forward<A2>(arg2));
-                add_epilog(msg, level);
-                write_to_streams(level, std::move(msg));
+                char inline_body[inline_message_size];
+                d_::FixedBuffer body(inline_body, sizeof(inline_body));
+                safe_sprintf(body, fmt, arg0, arg1, arg2);
+                if (!body.truncated())
+                    write_message(level, body.data(), body.size());
+                else
+                {
+                    // too long for the stack, so format again straight into the message
+                    std::string msg;
+                    start_message(msg, level, body.total_size());
+                    safe_sprintf(msg, fmt, arg0, arg1, arg2);
+                    finish_message(msg, level);
+                }
             }
             catch (const std::exception& ex)
             {
@@ -278,18 +439,67 @@ namespace vl
     private:
         friend class d_::LogWorker<T>;
 
+        // messages with a body up to this size are formatted on the stack
+        static const size_t inline_message_size = 1024;
+
+#ifdef VL_CONSTEXPR_SUPPORTED
+
+        // copies the time, thread id and arguments for the writer thread to format,
+        // false when some argument can only be streamed and must be formatted now
+        template <typename S, typename... Args>
+        bool log_deferred(LogLevel level, const d_::StaticFormat<S>& /*fmt*/, std::true_type /*capturable*/,
+                          const Args&... args)
+        {
+            d_::Work* work;
+            char* p = start_deferred(work, d_::captured_size(args...));
+            d_::capture_args(p, args...);
+            queue_deferred(work, level, &d_::format_captured<S, typename std::decay<Args>::type...>);
+            return true;
+        }
+
+        template <typename S, typename... Args>
+        bool log_deferred(LogLevel /*level*/, const d_::StaticFormat<S>& /*fmt*/, std::false_type /*capturable*/,
+                          const Args&... /*args*/)
+        {
+            return false;
+        }
+
+#endif
+
+        // returns where the arguments of a deferred message are written in [work]
+        char* start_deferred(d_::Work*& work, size_t args_size);
+        void queue_deferred(d_::Work* work, LogLevel level, d_::CapturedFormat format);
+
         // work function
 
-        void add_prelude(std::string& out, LogLevel level);
+        void add_prelude(OutputBuffer& out, LogLevel level);
         void add_epilog(std::string& out, LogLevel level);
 
+        // message is allocated once with room for prelude, body and epilog
+        void write_message(LogLevel level, const char* body, size_t size);
+        void start_message(std::string& msg, LogLevel level, size_t body_size);
+        void finish_message(std::string& msg, LogLevel level);
+
+        // d_::Route of a queued message
+        unsigned int route(LogLevel level);
+        void queue_message(d_::Work* work, LogLevel level);
         void write_to_streams(LogLevel level, std::string&& msg);
         void log_error(const std::string& fmt, const char* error_msg);
 
         // private data
 
+        // recomputes min_level_ after the stream levels change
+        void update_min_level();
+        void update_deferred();
+
         struct Impl;
         Impl* pimpl_;
+
+        // lowest level enabled for any stream, nologging when none is
+        LogLevel min_level_;
+
+        // deferred option of a vl::Logger, checked without reaching into pimpl_
+        bool deferred_;
     };
 
 
@@ -301,16 +511,65 @@ namespace vl
     void set_logger(const Logger& logger);
 
 
+    // how vl::Logger messages are handed over to LogManager's writer thread
+    enum QueueMode
+    {
+        shared_queue,       // one lock-free queue for all threads
+        per_thread_queues   // a ring per producer thread, merged by time when written;
+                            // threads wait when their ring of 1024 messages is full
+    };
+
+    // what a thread logging into a full queue does
+    enum OverflowPolicy
+    {
+        block_producer,   // waits until the writer thread makes room
+        drop_newest,      // discards its message
+        drop_oldest,      // discards the oldest queued messages (its own in per_thread_queues mode),
+                          // or its message when all of them are already being written
+        drop_below_level  // discards its message if it is below QueueLimits::drop_level, waits otherwise
+    };
+
+    // bounds the memory held by queued messages, 0 is no limit; the number of
+    // dropped messages is logged when the queue drains
+    struct QueueLimits
+    {
+        QueueLimits()
+            : max_messages(0)
+            , max_bytes(0)
+            , policy(block_producer)
+            , drop_level(warning)
+        { }
+
+        size_t max_messages;
+        size_t max_bytes;
+        OverflowPolicy policy;
+        LogLevel drop_level;
+    };
+
+
+    // which threads write vl::Logger messages to the streams
+    enum WriterMode
+    {
+        single_writer,    // LogManager's writer thread writes to all streams
+        writer_per_sink   // a thread per stream, cout and cerr, each with its own queue,
+                          // so a stalled stream does not hold up the others
+    };
+
+
     class LogManager
     {
     public:
-        LogManager();
+        explicit LogManager(QueueMode mode = shared_queue,
+                            const QueueLimits& limits = QueueLimits(),
+                            WriterMode writers = single_writer);
         ~LogManager();
 
     private:
         friend vl::Logger get_logger(const std::string& name);
         friend void set_logger(const Logger& logger);
-        friend void d_::queue_work(d_::Work&& work);
+        friend d_::Work* d_::acquire_work();
+        friend void d_::queue_work(d_::Work* work);
+        friend unsigned int d_::sink_slot(d_::SinkSetHandle& handle);
 
         void writer_loop();
 
@@ -337,14 +596,17 @@ namespace vl
             template <typename A>
             LogWorker& operator<<(A arg)
             {
+                if (!enabled_)
+                    return *this;
+
                 if (quote_)
-                    msg_stream_ << '"';
+                    *msg_stream_ << '"';
 
-                msg_stream_ << arg;
+                *msg_stream_ << arg;
 
                 if (quote_)
                 {
-                    msg_stream_ << '"';
+                    *msg_stream_ << '"';
                     quote_ = false;
                 }
 
@@ -355,13 +617,15 @@ namespace vl
 
             LogWorker& operator<<(std::ostream& (*manip)(std::ostream&))
             {
-                manip(msg_stream_);
+                if (enabled_)
+                    manip(*msg_stream_);
                 return *this;
             }
 
             LogWorker& operator<<(std::ios_base& (*manip)(std::ios_base&))
             {
-                manip(msg_stream_);
+                if (enabled_)
+                    manip(*msg_stream_);
                 return *this;
             }
 
@@ -379,9 +643,101 @@ namespace vl
             
             LoggerT<T>*        logger_;
             LogLevel           msg_level_;
-            std::ostringstream msg_stream_;
+            std::unique_ptr<std::ostringstream> msg_stream_;  // only created when enabled
             unsigned int       options_;
             bool               quote_;
+            bool               enabled_;  // level passes the logger's should_log
         };
     }
 }
+
+
+/*
+ * Logging macros that check the level before evaluating the arguments, so a
+ * disabled message costs a single comparison:
+ *     VL_DEBUG(logger, "state: {0}", expensive_dump());
+ *     VL_DEBUG_STREAM(logger) << "state:" << expensive_dump();
+ * [logger] and [level] may be evaluated more than once.
+ */
+#define VL_LOG(logger, level, ...)                                                  \
+    do                                                                              \
+    {                                                                               \
+        if ((logger).should_log(level))                                             \
+            (logger).log(level, __VA_ARGS__);                                       \
+    } while (false)
+
+// levels below VL_ACTIVE_LEVEL expand to this, the call is still type checked,
+// but never executed, so optimized builds drop it and its format string
+#define VL_LOG_DISABLED(logger, level, ...)                                         \
+    do                                                                              \
+    {                                                                               \
+        if (false)                                                                  \
+            (logger).log(level, __VA_ARGS__);                                       \
+    } while (false)
+
+#if VL_ACTIVE_LEVEL <= VL_LEVEL_DEBUG
+    #define VL_DEBUG(logger, ...) VL_LOG(logger, ::vl::debug, __VA_ARGS__)
+#else
+    #define VL_DEBUG(logger, ...) VL_LOG_DISABLED(logger, ::vl::debug, __VA_ARGS__)
+#endif
+
+#if VL_ACTIVE_LEVEL <= VL_LEVEL_INFO
+    #define VL_INFO(logger, ...) VL_LOG(logger, ::vl::info, __VA_ARGS__)
+#else
+    #define VL_INFO(logger, ...) VL_LOG_DISABLED(logger, ::vl::info, __VA_ARGS__)
+#endif
+
+#if VL_ACTIVE_LEVEL <= VL_LEVEL_WARNING
+    #define VL_WARNING(logger, ...) VL_LOG(logger, ::vl::warning, __VA_ARGS__)
+#else
+    #define VL_WARNING(logger, ...) VL_LOG_DISABLED(logger, ::vl::warning, __VA_ARGS__)
+#endif
+
+#if VL_ACTIVE_LEVEL <= VL_LEVEL_ERROR
+    #define VL_ERROR(logger, ...) VL_LOG(logger, ::vl::error, __VA_ARGS__)
+#else
+    #define VL_ERROR(logger, ...) VL_LOG_DISABLED(logger, ::vl::error, __VA_ARGS__)
+#endif
+
+#if VL_ACTIVE_LEVEL <= VL_LEVEL_CRITICAL
+    #define VL_CRITICAL(logger, ...) VL_LOG(logger, ::vl::critical, __VA_ARGS__)
+#else
+    #define VL_CRITICAL(logger, ...) VL_LOG_DISABLED(logger, ::vl::critical, __VA_ARGS__)
+#endif
+
+// the else branch keeps an enclosing if/else intact
+#define VL_LOG_STREAM(logger, level)                                                \
+    if (!(logger).should_log(level)) {} else (logger).log(level)
+
+#define VL_LOG_STREAM_DISABLED(logger, level)                                       \
+    if (true) {} else (logger).log(level)
+
+#if VL_ACTIVE_LEVEL <= VL_LEVEL_DEBUG
+    #define VL_DEBUG_STREAM(logger) VL_LOG_STREAM(logger, ::vl::debug)
+#else
+    #define VL_DEBUG_STREAM(logger) VL_LOG_STREAM_DISABLED(logger, ::vl::debug)
+#endif
+
+#if VL_ACTIVE_LEVEL <= VL_LEVEL_INFO
+    #define VL_INFO_STREAM(logger) VL_LOG_STREAM(logger, ::vl::info)
+#else
+    #define VL_INFO_STREAM(logger) VL_LOG_STREAM_DISABLED(logger, ::vl::info)
+#endif
+
+#if VL_ACTIVE_LEVEL <= VL_LEVEL_WARNING
+    #define VL_WARNING_STREAM(logger) VL_LOG_STREAM(logger, ::vl::warning)
+#else
+    #define VL_WARNING_STREAM(logger) VL_LOG_STREAM_DISABLED(logger, ::vl::warning)
+#endif
+
+#if VL_ACTIVE_LEVEL <= VL_LEVEL_ERROR
+    #define VL_ERROR_STREAM(logger) VL_LOG_STREAM(logger, ::vl::error)
+#else
+    #define VL_ERROR_STREAM(logger) VL_LOG_STREAM_DISABLED(logger, ::vl::error)
+#endif
+
+#if VL_ACTIVE_LEVEL <= VL_LEVEL_CRITICAL
+    #define VL_CRITICAL_STREAM(logger) VL_LOG_STREAM(logger, ::vl::critical)
+#else
+    #define VL_CRITICAL_STREAM(logger) VL_LOG_STREAM_DISABLED(logger, ::vl::critical)
+#endif
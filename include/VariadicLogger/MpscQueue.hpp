@@ -0,0 +1,191 @@
+/*
+ *  Copyright (c) 2013, Vitalii Turinskyi
+ *  All rights reserved.
+ *
+ *  Distributed under the Boost Software License, Version 1.0. (See accompanying
+ *  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+ */
+#pragma once
+
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace vl
+{
+    /*
+     * Unbounded multi-producer single-consumer queue (Dmitry Vyukov's design).
+     * Pushing is a single atomic exchange, so producers never block each other
+     * or the consumer. A push that is still in progress hides the items after
+     * it from the consumer until it completes. Consumer side calls may come
+     * from different threads if they are serialized by a lock.
+     */
+    template <typename T>
+    class MpscQueue
+    {
+    public:
+        MpscQueue()
+            : head_(new Node)
+            , tail_(head_.load())
+        { }
+
+        ~MpscQueue()
+        {
+            Node* node = tail_;
+            Node* next = node->next.load();
+            delete node;
+
+            // nodes after the tail still hold their items
+            for (node = next; node != nullptr; node = next)
+            {
+                next = node->next.load();
+                node->item()->~T();
+                delete node;
+            }
+        }
+
+        // any thread
+        void push(T&& item)
+        {
+            Node* node = new Node;
+            new (&node->storage) T(std::move(item));
+
+            Node* prev = head_.exchange(node);
+            prev->next.store(node);
+        }
+
+        // consumer side only; calls [f] with each available item, returns their number
+        template <typename F>
+        size_t consume_all(F f)
+        {
+            size_t count = 0;
+
+            while (consume_one(f))
+                ++count;
+
+            return count;
+        }
+
+        // consumer side only; calls [f] with the oldest available item, false if there is none
+        template <typename F>
+        bool consume_one(F& f)
+        {
+            Node* next = tail_->next.load();
+            if (next == nullptr)
+                return false;
+
+            T* item = next->item();
+            f(*item);
+            item->~T();
+
+            // consumed node becomes the new empty tail
+            delete tail_;
+            tail_ = next;
+            return true;
+        }
+
+        // consumer side only
+        bool empty() const
+        {
+            return tail_->next.load() == nullptr && head_.load() == tail_;
+        }
+
+    private:
+        MpscQueue(const MpscQueue&);
+        MpscQueue& operator=(const MpscQueue&);
+
+        struct Node
+        {
+            Node() : next(nullptr) { }
+
+            T* item() { return reinterpret_cast<T*>(&storage); }
+
+            std::atomic<Node*> next;
+            typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type storage;
+        };
+
+        std::atomic<Node*> head_;  // last pushed node
+        Node* tail_;               // consumed node, its item is already destroyed
+    };
+
+
+    /*
+     * Intrusive variant of MpscQueue for items with a [std::atomic<T*> next]
+     * member, so pushing allocates nothing. The queue does not own the items,
+     * they belong to whoever pops them. Pops may come from different threads
+     * if they are serialized by a lock, empty() may be called without it.
+     */
+    template <typename T>
+    class IntrusiveMpscQueue
+    {
+    public:
+        IntrusiveMpscQueue()
+            : head_(&stub_)
+            , tail_(&stub_)
+            , stub_()
+        { }
+
+        // any thread
+        void push(T* item)
+        {
+            item->next.store(nullptr, std::memory_order_relaxed);
+
+            T* prev = head_.exchange(item);
+            prev->next.store(item);
+        }
+
+        // consumer side only; the oldest available item, nullptr if there is none
+        T* pop()
+        {
+            T* tail = tail_.load(std::memory_order_relaxed);
+            T* next = tail->next.load();
+
+            if (tail == &stub_)
+            {
+                if (next == nullptr)
+                    return nullptr;
+
+                tail_.store(next, std::memory_order_release);
+                tail = next;
+                next = next->next.load();
+            }
+
+            if (next != nullptr)
+            {
+                tail_.store(next, std::memory_order_release);
+                return tail;
+            }
+
+            // the last item can only be taken with the stub behind it
+            if (tail != head_.load())
+                return nullptr;  // push in progress
+
+            push(&stub_);
+
+            next = tail->next.load();
+            if (next != nullptr)
+            {
+                tail_.store(next, std::memory_order_release);
+                return tail;
+            }
+
+            return nullptr;
+        }
+
+        // consumer side, also while another thread pops under the lock
+        bool empty() const
+        {
+            return tail_.load(std::memory_order_acquire) == &stub_
+                && stub_.next.load() == nullptr && head_.load() == &stub_;
+        }
+
+    private:
+        IntrusiveMpscQueue(const IntrusiveMpscQueue&);
+        IntrusiveMpscQueue& operator=(const IntrusiveMpscQueue&);
+
+        std::atomic<T*> head_;  // last pushed item
+        std::atomic<T*> tail_;  // next item to pop, or the stub
+        T stub_;
+    };
+}
@@ -12,12 +12,23 @@
     #define VL_VARIADIC_TEMPLATES_SUPPORTED
 #endif
 
+// No constexpr before Visual Studio 2015
+#if (!defined(_MSC_VER) || _MSC_VER >= 1900)
+    #define VL_CONSTEXPR_SUPPORTED
+    #define VL_CONSTEXPR constexpr
+#else
+    #define VL_CONSTEXPR inline
+#endif
+
 #include <string>
 #include <sstream>
 #include <vector>
+#include <memory>
 #include <type_traits>
 #include <stdexcept>
 
+#include <string.h>
+
 namespace vl
 {
     class format_error : public std::runtime_error
@@ -27,6 +38,137 @@ namespace vl
         explicit format_error(const std::string& msg) : std::runtime_error(msg) {}
     };
 
+    /*
+     * Destination of formatted output. Derived classes provide the storage in
+     * grow(); output that does not fit after grow() is dropped, but still counted,
+     * so truncation can be detected.
+     */
+    class OutputBuffer
+    {
+    public:
+        virtual ~OutputBuffer() {}
+
+        void append(const char* s, size_t n)
+        {
+            total_ += n;
+            n = reserve(n);
+            if (n != 0)
+                memcpy(data_ + size_, s, n);
+            size_ += n;
+        }
+
+        void append(size_t n, char ch)
+        {
+            total_ += n;
+            n = reserve(n);
+            if (n != 0)
+                memset(data_ + size_, ch, n);
+            size_ += n;
+        }
+
+        void push_back(char ch)
+        {
+            ++total_;
+            if (reserve(1) != 0)
+                data_[size_++] = ch;
+        }
+
+        const char* data() const { return data_; }
+        size_t size() const { return size_; }
+
+        // size of the complete output, including the truncated part
+        size_t total_size() const { return total_; }
+        bool truncated() const { return total_ != size_; }
+
+    protected:
+        OutputBuffer(char* data, size_t capacity)
+            : data_(data), size_(0), capacity_(capacity), total_(0)
+        { }
+
+        // should make room for at least [capacity] characters by calling set_storage
+        virtual void grow(size_t capacity) = 0;
+
+        void set_storage(char* data, size_t capacity)
+        {
+            data_ = data;
+            capacity_ = capacity;
+        }
+
+        void reset()
+        {
+            size_ = 0;
+            total_ = 0;
+        }
+
+    private:
+        OutputBuffer(const OutputBuffer&);
+        OutputBuffer& operator=(const OutputBuffer&);
+
+        // returns how many of [n] characters fit
+        size_t reserve(size_t n)
+        {
+            if (n > capacity_ - size_)
+            {
+                grow(size_ + n);
+                if (n > capacity_ - size_)
+                    return capacity_ - size_;
+            }
+            return n;
+        }
+
+        char* data_;
+        size_t size_;
+        size_t capacity_;
+        size_t total_;
+    };
+
+
+    /*
+     * Buffer with [N] characters of inline storage, so formatting shorter messages
+     * makes no heap allocations. Longer output moves to the heap.
+     */
+    template <size_t N>
+    class MemoryBuffer : public OutputBuffer
+    {
+    public:
+        MemoryBuffer()
+            : OutputBuffer(store_, N)
+            , heap_()
+            , capacity_(N)
+        { }
+
+        std::string str() const { return std::string(data(), size()); }
+        void clear() { reset(); }
+
+    protected:
+        virtual void grow(size_t capacity)
+        {
+            size_t new_capacity = capacity_ * 2 > capacity ? capacity_ * 2 : capacity;
+            std::unique_ptr<char[]> storage(new char[new_capacity]);
+
+            memcpy(storage.get(), data(), size());
+            heap_.swap(storage);
+            capacity_ = new_capacity;
+            set_storage(heap_.get(), capacity_);
+        }
+
+    private:
+        char store_[N];
+        std::unique_ptr<char[]> heap_;
+        size_t capacity_;
+    };
+
+
+    // result of format_to into a fixed buffer
+    struct FormatResult
+    {
+        size_t size;        // characters written
+        size_t total_size;  // characters the complete output needs
+
+        bool truncated() const { return total_size != size; }
+    };
+
+
     namespace d_
     {
         enum SubstrType
@@ -42,178 +184,915 @@ namespace vl
             VT_Other
         };
 
-        struct Substring
+        const size_t npos = static_cast<size_t>(-1);
+
+        // Throws format_error; evaluating it inside a constant expression makes
+        // the compile-time parser reject the format string.
+        int format_failure(const char* what);
+
+        /*
+         * Parsed "[[fill]align][sign][#][0][width][,][.precision][type]" specifier.
+         * Zero align and type mean "default for the argument's type".
+         */
+        struct FormatSpec
+        {
+            VL_CONSTEXPR FormatSpec()
+                : fill(' '), align('\0'), sign('-'), alternate(false)
+                , width(0), thousands(false), precision(-1), type('\0')
+            { }
+
+            VL_CONSTEXPR FormatSpec(char fl, char al, char sg, bool alt, int w, bool th, int p, char t)
+                : fill(fl), align(al), sign(sg), alternate(alt)
+                , width(w), thousands(th), precision(p), type(t)
+            { }
+
+            VL_CONSTEXPR FormatSpec with_align(char fl, char al) const { return FormatSpec(fl, al, sign, alternate, width, thousands, precision, type); }
+            VL_CONSTEXPR FormatSpec with_sign(char sg) const { return FormatSpec(fill, align, sg, alternate, width, thousands, precision, type); }
+            VL_CONSTEXPR FormatSpec with_alternate() const { return FormatSpec(fill, align, sign, true, width, thousands, precision, type); }
+            VL_CONSTEXPR FormatSpec with_width(int w) const { return FormatSpec(fill, align, sign, alternate, w, thousands, precision, type); }
+            VL_CONSTEXPR FormatSpec with_thousands() const { return FormatSpec(fill, align, sign, alternate, width, true, precision, type); }
+            VL_CONSTEXPR FormatSpec with_precision(int p) const { return FormatSpec(fill, align, sign, alternate, width, thousands, p, type); }
+            VL_CONSTEXPR FormatSpec with_type(char t) const { return FormatSpec(fill, align, sign, alternate, width, thousands, precision, t); }
+
+            char fill;
+            char align;
+            char sign;
+            bool alternate;
+            int width;
+            bool thousands;
+            int precision;
+            char type;
+        };
+
+        /*
+         * One piece of a parsed format string. Text chunks are slices of the format
+         * string with doubled braces already collapsed, anchors additionally carry
+         * the argument index and the parsed specifier.
+         */
+        struct Chunk
         {
-            template <typename T>
-            Substring(SubstrType t, T&& c)
-                : type(t)
-                , content(std::forward<T>(c))
+            VL_CONSTEXPR Chunk()
+                : type(SubstrText), offset(0), length(0), index(-1), spec(), next(0)
+            { }
+
+            VL_CONSTEXPR Chunk(SubstrType t, size_t off, size_t len, int idx, FormatSpec sp, size_t nx)
+                : type(t), offset(off), length(len), index(idx), spec(sp), next(nx)
             { }
 
-            Substring(const Substring& other)
-                : type(other.type)
-                , content(other.content)
+            SubstrType type;
+            size_t offset;   // text, or the whole "{...}" for anchors
+            size_t length;
+            int index;
+            FormatSpec spec;
+            size_t next;     // offset of the following chunk
+        };
+
+        /*
+         * Format string grammar. Everything below is usable in constant expressions,
+         * so string literals wrapped in VL_FMT are parsed during compilation, and is
+         * shared with the runtime parser in split_format.
+         */
+
+        VL_CONSTEXPR bool is_digit(char ch) { return ch >= '0' && ch <= '9'; }
+        VL_CONSTEXPR bool in_set(char ch, const char* set) { return *set != '\0' && (*set == ch || in_set(ch, set + 1)); }
+
+        VL_CONSTEXPR size_t digits_end(const char* s, size_t pos, size_t n)
+        {
+            return pos < n && is_digit(s[pos]) ? digits_end(s, pos + 1, n) : pos;
+        }
+
+        VL_CONSTEXPR int parse_int(const char* s, size_t pos, size_t end, int acc = 0)
+        {
+            return pos == end ? acc : parse_int(s, pos + 1, end, acc * 10 + (s[pos] - '0'));
+        }
+
+        VL_CONSTEXPR size_t find_char(const char* s, size_t lo, size_t hi, char a, char b);
+
+        VL_CONSTEXPR size_t find_char_or(size_t found, const char* s, size_t lo, size_t hi, char a, char b)
+        {
+            return found != npos ? found : find_char(s, lo, hi, a, b);
+        }
+
+        // first [a] or [b] in [lo, hi); bisects to keep recursion depth logarithmic
+        VL_CONSTEXPR size_t find_char(const char* s, size_t lo, size_t hi, char a, char b)
+        {
+            return hi <= lo ? npos
+                 : hi - lo == 1 ? (s[lo] == a || s[lo] == b ? lo : npos)
+                 : find_char_or(find_char(s, lo, lo + (hi - lo) / 2, a, b), s, lo + (hi - lo) / 2, hi, a, b);
+        }
+
+        struct SpecCursor
+        {
+            VL_CONSTEXPR SpecCursor(FormatSpec sp, size_t p) : spec(sp), pos(p) { }
+
+            FormatSpec spec;
+            size_t pos;
+        };
+
+        VL_CONSTEXPR SpecCursor spec_align(const char* s, size_t n, SpecCursor c)
+        {
+            return c.pos + 1 < n && in_set(s[c.pos + 1], "<>=^") ? SpecCursor(c.spec.with_align(s[c.pos], s[c.pos + 1]), c.pos + 2)
+                 : c.pos < n && in_set(s[c.pos], "<>=^") ? SpecCursor(c.spec.with_align(c.spec.fill, s[c.pos]), c.pos + 1)
+                 : c;
+        }
+
+        VL_CONSTEXPR SpecCursor spec_sign(const char* s, size_t n, SpecCursor c)
+        {
+            return c.pos < n && in_set(s[c.pos], "+- ") ? SpecCursor(c.spec.with_sign(s[c.pos]), c.pos + 1) : c;
+        }
+
+        VL_CONSTEXPR SpecCursor spec_alternate(const char* s, size_t n, SpecCursor c)
+        {
+            return c.pos < n && s[c.pos] == '#' ? SpecCursor(c.spec.with_alternate(), c.pos + 1) : c;
+        }
+
+        // '0' enables sign-aware zero-padding
+        VL_CONSTEXPR SpecCursor spec_zero(const char* s, size_t n, SpecCursor c)
+        {
+            return c.pos < n && s[c.pos] == '0' ? SpecCursor(c.spec.with_align('0', '='), c.pos + 1) : c;
+        }
+
+        VL_CONSTEXPR SpecCursor spec_width(const char* s, size_t n, SpecCursor c)
+        {
+            return c.pos < n && is_digit(s[c.pos])
+                 ? SpecCursor(c.spec.with_width(parse_int(s, c.pos, digits_end(s, c.pos, n))), digits_end(s, c.pos, n))
+                 : c;
+        }
+
+        VL_CONSTEXPR SpecCursor spec_thousands(const char* s, size_t n, SpecCursor c)
+        {
+            return c.pos < n && s[c.pos] == ',' ? SpecCursor(c.spec.with_thousands(), c.pos + 1) : c;
+        }
+
+        VL_CONSTEXPR SpecCursor spec_precision(const char* s, size_t n, SpecCursor c)
+        {
+            return !(c.pos < n && s[c.pos] == '.') ? c
+                 : !(c.pos + 1 < n && is_digit(s[c.pos + 1])) ? (format_failure("Precision not specified after '.'"), c)
+                 : SpecCursor(c.spec.with_precision(parse_int(s, c.pos + 1, digits_end(s, c.pos + 1, n))), digits_end(s, c.pos + 1, n));
+        }
+
+        VL_CONSTEXPR SpecCursor spec_type(const char* s, size_t n, SpecCursor c)
+        {
+            return c.pos < n && in_set(s[c.pos], "sbdoxXeEfFgG%") ? SpecCursor(c.spec.with_type(s[c.pos]), c.pos + 1) : c;
+        }
+
+        VL_CONSTEXPR FormatSpec spec_end(size_t n, SpecCursor c)
+        {
+            return c.pos == n ? c.spec : (format_failure("Unknown symbols in format specifier"), c.spec);
+        }
+
+        // [s] points right after the ':' of an anchor, [n] is the length of the specifier
+        VL_CONSTEXPR FormatSpec parse_spec(const char* s, size_t n)
+        {
+            return spec_end(n,
+                   spec_type(s, n,
+                   spec_precision(s, n,
+                   spec_thousands(s, n,
+                   spec_width(s, n,
+                   spec_zero(s, n,
+                   spec_alternate(s, n,
+                   spec_sign(s, n,
+                   spec_align(s, n, SpecCursor(FormatSpec(), 0))))))))));
+        }
+
+        // [colon] is equal to [close] when there is no format specifier
+        VL_CONSTEXPR Chunk anchor_chunk(const char* s, size_t open, size_t colon, size_t close)
+        {
+            return colon == open + 1 ? (format_failure("No position marker provided"), Chunk())
+                 : digits_end(s, open + 1, colon) != colon ? (format_failure("Error in position marker"), Chunk())
+                 : Chunk(SubstrAnchor, open, close - open + 1, parse_int(s, open + 1, colon),
+                         colon == close ? FormatSpec() : parse_spec(s + colon + 1, close - colon - 1),
+                         close + 1);
+        }
+
+        VL_CONSTEXPR Chunk anchor_chunk(const char* s, size_t open, size_t close)
+        {
+            return close == npos ? (format_failure("Error in format string: no closing curly brace."), Chunk())
+                 : anchor_chunk(s, open, find_char(s, open + 1, close, ':', ':') == npos ? close : find_char(s, open + 1, close, ':', ':'), close);
+        }
+
+        // chunk starting at [pos] given the position of the first brace at or after it
+        VL_CONSTEXPR Chunk chunk_at_brace(const char* s, size_t n, size_t pos, size_t brace)
+        {
+            return brace == npos ? Chunk(SubstrText, pos, n - pos, -1, FormatSpec(), n)
+                 // doubled braces are emitted once
+                 : brace + 1 < n && s[brace + 1] == s[brace] ? Chunk(SubstrText, pos, brace + 1 - pos, -1, FormatSpec(), brace + 2)
+                 // lone closing brace is left as is
+                 : s[brace] == '}' ? Chunk(SubstrText, pos, brace + 1 - pos, -1, FormatSpec(), brace + 1)
+                 : brace != pos ? Chunk(SubstrText, pos, brace - pos, -1, FormatSpec(), brace)
+                 : anchor_chunk(s, brace, find_char(s, brace + 1, n, '}', '}'));
+        }
+
+        VL_CONSTEXPR Chunk chunk_at(const char* s, size_t n, size_t pos)
+        {
+            return chunk_at_brace(s, n, pos, find_char(s, pos, n, '{', '}'));
+        }
+
+        VL_CONSTEXPR size_t count_chunks(const char* s, size_t n, size_t pos = 0)
+        {
+            return pos >= n ? 0 : 1 + count_chunks(s, n, chunk_at(s, n, pos).next);
+        }
+
+        VL_CONSTEXPR Chunk nth_chunk(const char* s, size_t n, size_t k, size_t pos = 0)
+        {
+            return k == 0 ? chunk_at(s, n, pos) : nth_chunk(s, n, k - 1, chunk_at(s, n, pos).next);
+        }
+
+        template <typename A>
+        VL_CONSTEXPR ValueType value_type()
+        {
+            return std::is_integral<typename std::decay<A>::type>::value ? VT_Integral
+                 : std::is_floating_point<typename std::decay<A>::type>::value ? VT_Floating
+                 : VT_Other;
+        }
+
+        // runtime format string, taken from a literal or a std::string without copying it
+        struct FormatView
+        {
+            FormatView(const char* s) : data(s), size(strlen(s)) { }
+            FormatView(const std::string& s) : data(s.data()), size(s.size()) { }
+
+            const char* data;
+            size_t size;
+        };
+
+        // parsed runtime format string; chunks are slices of its own copy of the
+        // text, so literal text is copied only into the output
+        struct Split
+        {
+            std::string fmt;
+            std::vector<Chunk> chunks;
+        };
+
+        typedef std::shared_ptr<const Split> SplitPtr;
+
+        SplitPtr split_format(FormatView fmt);
+
+        // split_format through the format cache
+        SplitPtr cached_split(FormatView fmt);
+
+        void modify_stream(std::ostringstream& oss, const FormatSpec& spec, ValueType type);
+
+        // writes integers without iostreams, [magnitude] is the absolute value
+        void format_integer(OutputBuffer& out, const FormatSpec& spec, unsigned long long magnitude, bool negative);
+
+        // writes floating point numbers without iostreams, [single] for float arguments
+        void format_float(OutputBuffer& out, const FormatSpec& spec, double value, bool single);
+
+        // writes text, precision is the maximum number of characters
+        void format_string(OutputBuffer& out, const FormatSpec& spec, const char* s, size_t n);
+
+        // characters are integral, but are printed as text
+        template <typename A>
+        struct is_character
+            : std::integral_constant<bool, std::is_same<A, char>::value
+                                        || std::is_same<A, signed char>::value
+                                        || std::is_same<A, unsigned char>::value
+                                        || std::is_same<A, wchar_t>::value
+                                        || std::is_same<A, char16_t>::value
+                                        || std::is_same<A, char32_t>::value>
+        { };
+
+        template <typename A>
+        bool is_negative(const A& arg, std::true_type /*is_signed*/) { return arg < 0; }
+
+        template <typename A>
+        bool is_negative(const A& /*arg*/, std::false_type /*is_signed*/) { return false; }
+
+        enum ArgKind
+        {
+            AK_Integer,
+            AK_Floating,
+            AK_Char,
+            AK_String,
+            AK_Stream   // anything else goes through operator<<
+        };
+
+        // characters not owned by the argument, e. g. a string captured for later formatting
+        struct StringView
+        {
+            const char* data;
+            size_t size;
+        };
+
+        template <typename A>
+        struct arg_kind
+            : std::integral_constant<ArgKind, std::is_integral<A>::value && !is_character<A>::value ? AK_Integer
+                                            : std::is_floating_point<A>::value ? AK_Floating
+                                            : std::is_same<A, char>::value
+                                              || std::is_same<A, signed char>::value
+                                              || std::is_same<A, unsigned char>::value ? AK_Char
+                                            : std::is_same<A, const char*>::value
+                                              || std::is_same<A, char*>::value
+                                              || std::is_same<A, std::string>::value
+                                              || std::is_same<A, StringView>::value ? AK_String
+                                            : AK_Stream>
+        { };
+
+        template <typename A>
+        void format_argument(OutputBuffer& out, const FormatSpec& spec, const A& arg, std::integral_constant<ArgKind, AK_Integer>)
+        {
+            bool negative = is_negative(arg, std::is_signed<A>());
+            unsigned long long value = static_cast<unsigned long long>(arg);
+            format_integer(out, spec, negative ? 0ull - value : value, negative);
+        }
+
+        template <typename A>
+        void format_argument(OutputBuffer& out, const FormatSpec& spec, const A& arg, std::integral_constant<ArgKind, AK_Floating>)
+        {
+            format_float(out, spec, static_cast<double>(arg), std::is_same<A, float>::value);
+        }
+
+        // characters are numbers only when asked for an integer presentation type
+        template <typename A>
+        void format_argument(OutputBuffer& out, const FormatSpec& spec, const A& arg, std::integral_constant<ArgKind, AK_Char>)
+        {
+            if (in_set(spec.type, "bdoxX"))
+            {
+                format_argument(out, spec, static_cast<int>(arg), std::integral_constant<ArgKind, AK_Integer>());
+            }
+            else
+            {
+                char ch = static_cast<char>(arg);
+                format_string(out, spec, &ch, 1);
+            }
+        }
+
+        inline void format_argument(OutputBuffer& out, const FormatSpec& spec, const std::string& arg, std::integral_constant<ArgKind, AK_String>)
+        {
+            format_string(out, spec, arg.data(), arg.size());
+        }
+
+        inline void format_argument(OutputBuffer& out, const FormatSpec& spec, const char* arg, std::integral_constant<ArgKind, AK_String>)
+        {
+            if (arg == nullptr)
+                arg = "(null)";
+            format_string(out, spec, arg, strlen(arg));
+        }
+
+        inline void format_argument(OutputBuffer& out, const FormatSpec& spec, const StringView& arg, std::integral_constant<ArgKind, AK_String>)
+        {
+            format_string(out, spec, arg.data, arg.size);
+        }
+
+        template <typename A>
+        void format_argument(OutputBuffer& out, const FormatSpec& spec, const A& arg, std::integral_constant<ArgKind, AK_Stream>)
+        {
+            std::ostringstream oss;
+            modify_stream(oss, spec, value_type<A>());
+            oss << arg;
+            std::string str = oss.str();
+            out.append(str.data(), str.size());
+        }
+
+        // appends [arg] formatted according to [spec] to [out]
+        template <typename A>
+        void format_argument(OutputBuffer& out, const FormatSpec& spec, const A& arg)
+        {
+            typedef typename std::decay<A>::type T;
+            format_argument(out, spec, arg, std::integral_constant<ArgKind, arg_kind<T>::value>());
+        }
+
+        /*
+         * Type-erased reference to an argument, so that anchors are dispatched to
+         * their arguments by index instead of by recursing over the argument pack.
+         */
+        struct Arg
+        {
+            const void* value;
+            void (*format)(OutputBuffer& out, const FormatSpec& spec, const void* value);
+        };
+
+        template <typename A>
+        void format_erased(OutputBuffer& out, const FormatSpec& spec, const void* value)
+        {
+            format_argument(out, spec, *static_cast<const A*>(value));
+        }
+
+        template <typename A>
+        Arg make_arg(const A& arg)
+        {
+            Arg result = { &arg, &format_erased<A> };
+            return result;
+        }
+
+        // anchors referring to missing arguments are left as is
+        void format_chunks(OutputBuffer& out, const char* fmt, const Chunk* chunks, size_t size, const Arg* args, size_t count);
+
+        // format_chunks of the cached split of [fmt]
+        void vformat(OutputBuffer& out, FormatView fmt, const Arg* args, size_t count);
+
+        // formats a message from arguments copied into a buffer, see format_captured
+        typedef void (*CapturedFormat)(OutputBuffer& out, const char* captured);
+
+        // appends to a string, writing straight into its storage
+        class StringBuffer : public OutputBuffer
+        {
+        public:
+            explicit StringBuffer(std::string& out)
+                : OutputBuffer(nullptr, 0)
+                , out_(out)
+                , start_(out.size())
+                , committed_(false)
             { }
 
-            Substring(Substring&& other)
-                : content()
+            // unless committed, the string is restored on destruction
+            ~StringBuffer()
             {
-                swap(*this, other);
+                out_.resize(start_ + (committed_ ? size() : 0));
             }
 
-            Substring& operator=(Substring rhs)
+            void commit() { committed_ = true; }
+
+        protected:
+            virtual void grow(size_t capacity)
             {
-                swap(*this, rhs);
-                return *this;
+                // resize fills the new characters, so grow by the output size rather
+                // than to the spare capacity of a possibly huge string
+                size_t current = out_.size() - start_;
+                size_t new_capacity = current * 2 > capacity ? current * 2 : capacity;
+
+                out_.resize(start_ + new_capacity);
+                set_storage(&out_[start_], new_capacity);
             }
 
-            friend void swap(Substring& fst, Substring& snd)
+        private:
+            std::string& out_;
+            size_t start_;
+            bool committed_;
+        };
+
+        // drops everything that does not fit
+        class FixedBuffer : public OutputBuffer
+        {
+        public:
+            FixedBuffer(char* data, size_t capacity)
+                : OutputBuffer(data, capacity)
+            { }
+
+            FormatResult result() const
             {
-                using std::swap;
-                swap(fst.type, snd.type);
-                swap(fst.content, snd.content);
+                FormatResult r = { size(), total_size() };
+                return r;
             }
 
-            SubstrType type;
-            std::string content;
+        protected:
+            virtual void grow(size_t /*capacity*/) {}
+        };
+
+#ifdef VL_CONSTEXPR_SUPPORTED
+
+        /*
+         * Format string literal captured in a type by VL_FMT. [S] provides str() and
+         * size() usable in constant expressions.
+         */
+        template <typename S>
+        struct StaticFormat
+        {
+            static std::string str() { return std::string(S::str(), S::size()); }
         };
 
-        typedef std::vector<Substring> Split;
+        template <size_t... I>
+        struct Indices {};
+
+        template <size_t N, size_t... I>
+        struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
 
-        Split split_format(const std::string& fmt);
-        void join(std::string& out, const Split& split);
-        bool has_index(const std::string& substr, int index);
-        void modify_stream(std::ostringstream& oss, const std::string& format, ValueType type);
+        template <size_t... I>
+        struct MakeIndices<0, I...> { typedef Indices<I...> type; };
 
+        // chunks of a StaticFormat, parsed during compilation
+        template <typename S, typename I = typename MakeIndices<count_chunks(S::str(), S::size())>::type>
+        struct ChunkTable;
+
+        template <typename S, size_t... I>
+        struct ChunkTable<S, Indices<I...> >
+        {
+            static const size_t size = sizeof...(I);
+            static constexpr Chunk chunks[sizeof...(I) + 1] = { nth_chunk(S::str(), S::size(), I)..., Chunk() };
+        };
+
+        template <typename S, size_t... I>
+        constexpr Chunk ChunkTable<S, Indices<I...> >::chunks[sizeof...(I) + 1];
+
+        // kind of [A] as far as format specs go, streamed numbers follow the number rules
         template <typename A>
-        Substring format_argument(const std::string& substr, A&& arg)
+        struct spec_kind
+            : std::integral_constant<ArgKind, arg_kind<A>::value != AK_Stream ? arg_kind<A>::value
+                                            : value_type<A>() == VT_Integral ? AK_Integer
+                                            : value_type<A>() == VT_Floating ? AK_Floating
+                                            : AK_Stream>
+        { };
+
+        template <typename... Args>
+        struct SpecKinds
         {
-            size_t pos = substr.find(':');
-            std::string format;
+            static constexpr ArgKind kinds[sizeof...(Args) + 1] = { spec_kind<typename std::decay<Args>::type>::value..., AK_Stream };
+        };
 
-            if (pos != substr.npos)
-                format = substr.substr(pos + 1);
+        template <typename... Args>
+        constexpr ArgKind SpecKinds<Args...>::kinds[sizeof...(Args) + 1];
 
-            std::ostringstream oss;
-            ValueType type = VT_Other;
+        // same rules as check_spec and the format_argument overloads apply at runtime
+        VL_CONSTEXPR bool spec_fits(const FormatSpec& f, ArgKind kind)
+        {
+            return kind == AK_Integer ? f.precision == -1 && (f.type == '\0' || in_set(f.type, "bdoxX"))
+                 : kind == AK_Floating ? f.type == '\0' || in_set(f.type, "eEfFgG%")
+                 : kind == AK_Char && in_set(f.type, "bdoxX") ? f.precision == -1
+                 : f.type == '\0' || f.type == 's';
+        }
 
-            if (std::is_integral<A>::value)
-                type = VT_Integral;
-            else if (std::is_floating_point<A>::value)
-                type = VT_Floating;
+        VL_CONSTEXPR bool anchors_in_range(const Chunk* chunks, size_t size, size_t count)
+        {
+            return size == 0
+                || ((chunks->type == SubstrText || static_cast<size_t>(chunks->index) < count)
+                    && anchors_in_range(chunks + 1, size - 1, count));
+        }
 
-            modify_stream(oss, format, type);
-            oss << arg;
-            return Substring(SubstrText, oss.str());
+        // expects anchors_in_range
+        VL_CONSTEXPR bool specs_fit(const Chunk* chunks, size_t size, const ArgKind* kinds)
+        {
+            return size == 0
+                || ((chunks->type == SubstrText || spec_fits(chunks->spec, kinds[chunks->index]))
+                    && specs_fit(chunks + 1, size - 1, kinds));
         }
 
-#ifdef VL_VARIADIC_TEMPLATES_SUPPORTED
+        // results of checking the format [F] against argument types [Args]
+        template <typename F, typename... Args>
+        struct StaticFormatCheck;
+
+        template <typename S, typename... Args>
+        struct StaticFormatCheck<StaticFormat<S>, Args...>
+        {
+            typedef ChunkTable<S> table;
+
+            static const bool anchors_valid = anchors_in_range(table::chunks, table::size, sizeof...(Args));
+            static const bool specs_valid = !anchors_valid || specs_fit(table::chunks, table::size, SpecKinds<Args...>::kinds);
+        };
 
-        // base case for variadic template handling recursion
-        inline void safe_sprintf_worker(int /*index*/, Split& /*fmt*/) {}
 
-        template <typename A, typename... Args>
-        void safe_sprintf_worker(int index, Split& fmt, A&& arg, Args&&... args)
+        /*
+         * Arguments copied into a byte buffer, so that the message can be formatted
+         * later on another thread. Numbers and characters are copied as they are,
+         * strings as their size followed by their characters; arguments printed
+         * through operator<< can not be captured.
+         */
+        template <typename A, ArgKind K = arg_kind<A>::value>
+        struct Capture
         {
-            for (Substring& substr : fmt)
+            typedef A stored;
+
+            static size_t size(const A& /*arg*/) { return sizeof(A); }
+
+            static char* write(char* p, const A& arg)
             {
-                if (substr.type == SubstrAnchor && has_index(substr.content, index))
-                    substr = format_argument(substr.content, std::forward<A>(arg));
+                memcpy(p, &arg, sizeof(A));
+                return p + sizeof(A);
             }
-            safe_sprintf_worker(index + 1, fmt, std::forward<Args>(args)...);
-        }
 
-#else  // limit to 3 arguments
+            static const char* read(const char* p, A& arg)
+            {
+                memcpy(&arg, p, sizeof(A));
+                return p + sizeof(A);
+            }
+        };
+
+        inline StringView string_view(const std::string& arg) { StringView v = { arg.data(), arg.size() }; return v; }
+        inline StringView string_view(const char* arg) { StringView v = { arg ? arg : "(null)", arg ? strlen(arg) : 6 }; return v; }
 
-        template <typename A0>
-        void safe_sprintf_worker(int index, Split& fmt, A0&& arg0)
+        template <typename A>
+        struct Capture<A, AK_String>
         {
-            for (Substring& substr : fmt)
+            typedef StringView stored;
+
+            static size_t size(const A& arg) { return sizeof(size_t) + string_view(arg).size; }
+
+            static char* write(char* p, const A& arg)
             {
-                if (substr.type == SubstrAnchor && has_index(substr.content, index))
-                    substr = format_argument(substr.content, std::forward<A0>(arg0));
+                StringView v = string_view(arg);
+                memcpy(p, &v.size, sizeof(size_t));
+                memcpy(p + sizeof(size_t), v.data, v.size);
+                return p + sizeof(size_t) + v.size;
             }
-        }
 
-        template <typename A0, typename A1>
-        void safe_sprintf_worker(int index, Split& fmt, A0&& arg0, A1&& arg1)
-        {
-            for (Substring& substr : fmt)
+            static const char* read(const char* p, StringView& arg)
             {
-                if (substr.type == SubstrAnchor && has_index(substr.content, index))
-                    substr = format_argument(substr.content, std::forward<A0>(arg0));
+                memcpy(&arg.size, p, sizeof(size_t));
+                arg.data = p + sizeof(size_t);
+                return arg.data + arg.size;
             }
-            safe_sprintf_worker(index + 1, fmt, std::forward<A1>(arg1));
+        };
+
+        template <typename A>
+        struct Capture<A, AK_Stream>;
+
+        template <typename... Args>
+        struct capturable;
+
+        template <>
+        struct capturable<> : std::true_type {};
+
+        template <typename A, typename... Rest>
+        struct capturable<A, Rest...>
+            : std::integral_constant<bool, arg_kind<typename std::decay<A>::type>::value != AK_Stream
+                                           && capturable<Rest...>::value>
+        { };
+
+        inline size_t captured_size() { return 0; }
+
+        template <typename A, typename... Rest>
+        size_t captured_size(const A& arg, const Rest&... rest)
+        {
+            return Capture<typename std::decay<const A>::type>::size(arg) + captured_size(rest...);
         }
 
-        template <typename A0, typename A1, typename A2>
-        void safe_sprintf_worker(int index, Split& fmt, A0&& arg0, A1&& arg1, A2&& arg2)
+        // writes captured_size bytes, returns their end
+        inline char* capture_args(char* p) { return p; }
+
+        template <typename A, typename... Rest>
+        char* capture_args(char* p, const A& arg, const Rest&... rest)
         {
-            for (Substring& substr : fmt)
-            {
-                if (substr.type == SubstrAnchor && has_index(substr.content, index))
-                    substr = format_argument(substr.content, std::forward<A0>(arg0));
-            }
-            safe_sprintf_worker(index + 1, fmt, std::forward<A1>(arg1), std::forward<A2>(arg2));
+            return capture_args(Capture<typename std::decay<const A>::type>::write(p, arg), rest...);
+        }
+
+        // each argument is read into a local that lives until the message is formatted
+        template <typename S>
+        void format_captured_from(OutputBuffer& out, const char* /*captured*/, Arg* args, size_t count)
+        {
+            typedef ChunkTable<S> table;
+            format_chunks(out, S::str(), table::chunks, table::size, args, count);
+        }
+
+        template <typename S, typename A, typename... Rest>
+        void format_captured_from(OutputBuffer& out, const char* captured, Arg* args, size_t count)
+        {
+            typename Capture<A>::stored arg;
+            captured = Capture<A>::read(captured, arg);
+            args[count] = make_arg(arg);
+            format_captured_from<S, Rest...>(out, captured, args, count + 1);
+        }
+
+        // formats the format [S] with arguments of types [Args] written by capture_args
+        template <typename S, typename... Args>
+        void format_captured(OutputBuffer& out, const char* captured)
+        {
+            Arg args[sizeof...(Args) + 1] = {};
+            format_captured_from<S, Args...>(out, captured, args, 0);
         }
 
 #endif
     }
 
+    /*
+     * Parsed format strings are kept in a bounded cache, so repeated calls with
+     * the same format string skip parsing. Strings are looked up by address, a
+     * string rebuilt for each call is parsed each time. Setting capacity to 0
+     * disables it. The capacity is divided among 16 shards, each evicting
+     * about its least recently used entry, so small capacities cache only some
+     * format strings.
+     */
+    struct FormatCacheStats
+    {
+        size_t hits;
+        size_t misses;
+        size_t size;
+        size_t capacity;
+    };
+
+    FormatCacheStats format_cache_stats();
+    void set_format_cache_capacity(size_t capacity);
+    void clear_format_cache();
+
 #ifdef VL_VARIADIC_TEMPLATES_SUPPORTED
 
     /*
-     * Appends string formatted according to [fmt] and specified arguments [args] to [out] string.
+     * Appends string formatted according to [fmt] and specified arguments [args] to [out].
+     * MemoryBuffer as [out] avoids heap allocations for short output.
      */
+    template <typename... Args>
+    void safe_sprintf(OutputBuffer& out, d_::FormatView fmt, Args&&... args)
+    {
+        const d_::Arg packed[] = { d_::make_arg(args)..., d_::Arg() };
+        d_::vformat(out, fmt, packed, sizeof...(Args));
+    }
+
     template <typename... Args>
     void safe_sprintf(std::string& out, const std::string& fmt, Args&&... args)
     {
-        auto split = d_::split_format(fmt);
-        d_::safe_sprintf_worker(0, split, std::forward<Args>(args)...);
-        d_::join(out, split);
+        d_::StringBuffer buffer(out);
+        safe_sprintf(buffer, fmt, std::forward<Args>(args)...);
+        buffer.commit();
     }
 
     // Version returning formatted string
     template <typename... Args>
     std::string safe_sprintf_ret(const std::string& fmt, Args&&... args)
     {
-        auto split = d_::split_format(fmt);
-        d_::safe_sprintf_worker(0, split, std::forward<Args>(args)...);
         std::string out;
-        d_::join(out, split);
+        safe_sprintf(out, fmt, std::forward<Args>(args)...);
         return out;
     }
 
+    /*
+     * Writes at most [capacity] characters to [buf] without allocating memory, once
+     * [fmt] is in the format cache. Output is not null-terminated.
+     */
+    template <typename... Args>
+    FormatResult format_to(char* buf, size_t capacity, d_::FormatView fmt, Args&&... args)
+    {
+        d_::FixedBuffer buffer(buf, capacity);
+        safe_sprintf(buffer, fmt, std::forward<Args>(args)...);
+        return buffer.result();
+    }
+
+    // Size of the output of safe_sprintf with the same arguments, computed without storing it
+    template <typename... Args>
+    size_t formatted_size(d_::FormatView fmt, Args&&... args)
+    {
+        return format_to(nullptr, 0, fmt, std::forward<Args>(args)...).total_size;
+    }
+
 #else  // limit to 3 arguments
 
+    inline void safe_sprintf(OutputBuffer& out, d_::FormatView fmt)
+    {
+        d_::vformat(out, fmt, nullptr, 0);
+    }
+
+    template <typename A0>
+    void safe_sprintf(OutputBuffer& out, d_::FormatView fmt, A0&& arg0)
+    {
+        const d_::Arg packed[] = { d_::make_arg(arg0) };
+        d_::vformat(out, fmt, packed, 1);
+    }
+
+    template <typename A0, typename A1>
+    void safe_sprintf(OutputBuffer& out, d_::FormatView fmt, A0&& arg0, A1&& arg1)
+    {
+        const d_::Arg packed[] = { d_::make_arg(arg0), d_::make_arg(arg1) };
+        d_::vformat(out, fmt, packed, 2);
+    }
+
+    template <typename A0, typename A1, typename A2>
+    void safe_sprintf(OutputBuffer& out, d_::FormatView fmt, A0&& arg0, A1&& arg1, A2&& arg2)
+    {
+        const d_::Arg packed[] = { d_::make_arg(arg0), d_::make_arg(arg1), d_::make_arg(arg2) };
+        d_::vformat(out, fmt, packed, 3);
+    }
+
     inline void safe_sprintf(std::string& out, const std::string& fmt)
     {
-        out.append(fmt);
+        d_::StringBuffer buffer(out);
+        safe_sprintf(buffer, fmt);
+        buffer.commit();
     }
 
     template <typename A0>
     void safe_sprintf(std::string& out, const std::string& fmt, A0&& arg0)
     {
-        auto split = d_::split_format(fmt);
-        d_::safe_sprintf_worker(0, split, std::forward<A0>(arg0));
-        d_::join(out, split);
+        d_::StringBuffer buffer(out);
+        safe_sprintf(buffer, fmt, std::forward<A0>(arg0));
+        buffer.commit();
     }
 
     template <typename A0, typename A1>
     void safe_sprintf(std::string& out, const std::string& fmt, A0&& arg0, A1&& arg1)
     {
-        auto split = d_::split_format(fmt);
-        d_::safe_sprintf_worker(0, split, std::forward<A0>(arg0), std::forward<A1>(arg1));
-        d_::join(out, split);
+        d_::StringBuffer buffer(out);
+        safe_sprintf(buffer, fmt, std::forward<A0>(arg0), std::forward<A1>(arg1));
+        buffer.commit();
     }
 
     template <typename A0, typename A1, typename A2>
     void safe_sprintf(std::string& out, const std::string& fmt, A0&& arg0, A1&& arg1, A2&& arg2)
     {
-        auto split = d_::split_format(fmt);
-        d_::safe_sprintf_worker(0, split, std::forward<A0>(arg0), std::forward<A1>(arg1), std::forward<A2>(arg2));
-        d_::join(out, split);
+        d_::StringBuffer buffer(out);
+        safe_sprintf(buffer, fmt, std::forward<A0>(arg0), std::forward<A1>(arg1), std::forward<A2>(arg2));
+        buffer.commit();
+    }
+
+    inline FormatResult format_to(char* buf, size_t capacity, d_::FormatView fmt)
+    {
+        d_::FixedBuffer buffer(buf, capacity);
+        safe_sprintf(buffer, fmt);
+        return buffer.result();
+    }
+
+    template <typename A0>
+    FormatResult format_to(char* buf, size_t capacity, d_::FormatView fmt, A0&& arg0)
+    {
+        d_::FixedBuffer buffer(buf, capacity);
+        safe_sprintf(buffer, fmt, std::forward<A0>(arg0));
+        return buffer.result();
+    }
+
+    template <typename A0, typename A1>
+    FormatResult format_to(char* buf, size_t capacity, d_::FormatView fmt, A0&& arg0, A1&& arg1)
+    {
+        d_::FixedBuffer buffer(buf, capacity);
+        safe_sprintf(buffer, fmt, std::forward<A0>(arg0), std::forward<A1>(arg1));
+        return buffer.result();
+    }
+
+    template <typename A0, typename A1, typename A2>
+    FormatResult format_to(char* buf, size_t capacity, d_::FormatView fmt, A0&& arg0, A1&& arg1, A2&& arg2)
+    {
+        d_::FixedBuffer buffer(buf, capacity);
+        safe_sprintf(buffer, fmt, std::forward<A0>(arg0), std::forward<A1>(arg1), std::forward<A2>(arg2));
+        return buffer.result();
+    }
+
+    inline size_t formatted_size(d_::FormatView fmt)
+    {
+        return format_to(nullptr, 0, fmt).total_size;
+    }
+
+    template <typename A0>
+    size_t formatted_size(d_::FormatView fmt, A0&& arg0)
+    {
+        return format_to(nullptr, 0, fmt, std::forward<A0>(arg0)).total_size;
+    }
+
+    template <typename A0, typename A1>
+    size_t formatted_size(d_::FormatView fmt, A0&& arg0, A1&& arg1)
+    {
+        return format_to(nullptr, 0, fmt, std::forward<A0>(arg0), std::forward<A1>(arg1)).total_size;
+    }
+
+    template <typename A0, typename A1, typename A2>
+    size_t formatted_size(d_::FormatView fmt, A0&& arg0, A1&& arg1, A2&& arg2)
+    {
+        return format_to(nullptr, 0, fmt, std::forward<A0>(arg0), std::forward<A1>(arg1), std::forward<A2>(arg2)).total_size;
+    }
+
+#endif
+
+#ifdef VL_CONSTEXPR_SUPPORTED
+
+    /*
+     * Same as above for format strings wrapped in VL_FMT, which are parsed during
+     * compilation, so only text and arguments are written at runtime. Anchors without
+     * an argument and specifiers not fitting the argument type fail to compile.
+     */
+    template <typename S, typename... Args>
+    void safe_sprintf(OutputBuffer& out, const d_::StaticFormat<S>& /*fmt*/, Args&&... args)
+    {
+        typedef d_::StaticFormatCheck<d_::StaticFormat<S>, Args...> check;
+        static_assert(check::anchors_valid, "VL_FMT format string refers to a missing argument");
+        static_assert(check::specs_valid, "VL_FMT format specifier does not fit the argument type");
+
+        typedef d_::ChunkTable<S> table;
+        const d_::Arg packed[] = { d_::make_arg(args)..., d_::Arg() };
+        d_::format_chunks(out, S::str(), table::chunks, table::size, packed, sizeof...(Args));
+    }
+
+    template <typename S, typename... Args>
+    void safe_sprintf(std::string& out, const d_::StaticFormat<S>& fmt, Args&&... args)
+    {
+        d_::StringBuffer buffer(out);
+        safe_sprintf(buffer, fmt, std::forward<Args>(args)...);
+        buffer.commit();
+    }
+
+    template <typename S, typename... Args>
+    std::string safe_sprintf_ret(const d_::StaticFormat<S>& fmt, Args&&... args)
+    {
+        std::string out;
+        safe_sprintf(out, fmt, std::forward<Args>(args)...);
+        return out;
+    }
+
+    template <typename S, typename... Args>
+    FormatResult format_to(char* buf, size_t capacity, const d_::StaticFormat<S>& fmt, Args&&... args)
+    {
+        d_::FixedBuffer buffer(buf, capacity);
+        safe_sprintf(buffer, fmt, std::forward<Args>(args)...);
+        return buffer.result();
+    }
+
+    template <typename S, typename... Args>
+    size_t formatted_size(const d_::StaticFormat<S>& fmt, Args&&... args)
+    {
+        return format_to(nullptr, 0, fmt, std::forward<Args>(args)...).total_size;
     }
 
 #endif
 }
+
+#ifdef VL_CONSTEXPR_SUPPORTED
+
+/*
+ * Wraps a format string literal for parsing during compilation:
+ *     vl::safe_sprintf(out, VL_FMT("{0} of {1}"), done, total);
+ */
+#define VL_FMT(s)                                                                   \
+    ([] {                                                                           \
+        struct vl_fmt_literal                                                       \
+        {                                                                           \
+            static constexpr const char* str() { return s; }                        \
+            static constexpr size_t size() { return sizeof(s) - 1; }                \
+        };                                                                          \
+        return ::vl::d_::StaticFormat<vl_fmt_literal>();                            \
+    }())
+
+#endif
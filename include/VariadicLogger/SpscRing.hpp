@@ -0,0 +1,88 @@
+/*
+ *  Copyright (c) 2013, Vitalii Turinskyi
+ *  All rights reserved.
+ *
+ *  Distributed under the Boost Software License, Version 1.0. (See accompanying
+ *  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+ */
+#pragma once
+
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <stddef.h>
+
+namespace vl
+{
+    /*
+     * Bounded single-producer single-consumer ring of [N] items. The producer
+     * only writes head_ and the consumer only writes tail_, which are kept on
+     * separate cache lines. Consumer side calls may come from different
+     * threads if they are serialized by a lock.
+     */
+    template <typename T, size_t N>
+    class SpscRing
+    {
+    public:
+        SpscRing()
+            : head_(0)
+            , tail_(0)
+        { }
+
+        ~SpscRing()
+        {
+            while (!empty())
+                pop();
+        }
+
+        // producer thread only; false when the ring is full
+        bool push(T&& item)
+        {
+            size_t head = head_.load(std::memory_order_relaxed);
+
+            if (head - tail_.load(std::memory_order_acquire) == N)
+                return false;
+
+            new (&slots_[head % N]) T(std::move(item));
+
+            // sequentially consistent, so the consumer either sees the item or
+            // the producer sees that the consumer has parked
+            head_.store(head + 1);
+            return true;
+        }
+
+        // consumer side only
+        bool empty() const
+        {
+            return tail_.load(std::memory_order_relaxed) == head_.load();
+        }
+
+        // consumer side only, ring is not empty
+        T& front()
+        {
+            return *reinterpret_cast<T*>(&slots_[tail_.load(std::memory_order_relaxed) % N]);
+        }
+
+        // consumer side only, ring is not empty
+        void pop()
+        {
+            size_t tail = tail_.load(std::memory_order_relaxed);
+            reinterpret_cast<T*>(&slots_[tail % N])->~T();
+            tail_.store(tail + 1, std::memory_order_release);
+        }
+
+    private:
+        SpscRing(const SpscRing&);
+        SpscRing& operator=(const SpscRing&);
+
+        static const size_t cache_line = 64;
+
+        std::atomic<size_t> head_;  // next slot to write
+        char head_padding_[cache_line - sizeof(std::atomic<size_t>)];
+        std::atomic<size_t> tail_;  // next slot to read
+        char tail_padding_[cache_line - sizeof(std::atomic<size_t>)];
+        typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type slots_[N];
+    };
+}
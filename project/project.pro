@@ -31,7 +31,10 @@ CONFIG( release, debug|release )  {
 HEADERS += \
     ../include/VariadicLogger/SafeSprintf.h \
     ../include/VariadicLogger/Logger.h \
-    ../include/VariadicLogger/Event.hpp
+    ../include/VariadicLogger/Event.hpp \
+    ../include/VariadicLogger/Doorbell.hpp \
+    ../include/VariadicLogger/MpscQueue.hpp \
+    ../include/VariadicLogger/SpscRing.hpp
 
 SOURCES += \
     ../src/SafeSprintf.cpp \
@@ -7,7 +7,9 @@
  */
 #include "VariadicLogger/Logger.h"
 
-#include "VariadicLogger/Event.hpp"
+#include "VariadicLogger/Doorbell.hpp"
+#include "VariadicLogger/MpscQueue.hpp"
+#include "VariadicLogger/SpscRing.hpp"
 
 #include <thread>
 #include <memory>
@@ -18,14 +20,47 @@
 #include <fstream>
 #include <map>
 #include <atomic>
-#include <queue>
-#include <list>
+#include <algorithm>
+#include <chrono>
 
 #include <time.h>
 #include <assert.h>
 #include <string.h>
 
+// all date and time fields of patterns are cut from text in this format
 #define TIMESTAMP_FORMAT "%Y-%m-%d %H:%M:%S"
+#define TIMESTAMP_SIZE   19
+
+// layout of messages when no pattern is set, parts are left out according to LogOpts
+#define PATTERN_TIMESTAMP "%Y-%m-%d %H:%M:%S[%f] "
+#define PATTERN_NAME      "[%n] "
+#define PATTERN_THREAD_ID "%t "
+#define PATTERN_LEVEL     "<%l> "
+
+// for trivial types only, C++11 thread_local is not available everywhere
+#ifdef _MSC_VER
+    #define VL_THREAD_LOCAL __declspec(thread)
+#else
+    #define VL_THREAD_LOCAL __thread
+#endif
+
+// thread_local objects with destructors
+#if (!defined(_MSC_VER) || _MSC_VER >= 1900)
+    #define VL_THREAD_LOCAL_OBJECTS_SUPPORTED
+#endif
+
+// messages a producer thread can have queued in per_thread_queues mode
+#define THREAD_RING_SIZE 1024
+
+// the writer thread writes and flushes gathered messages at least this often
+#define WRITER_BATCH_SIZE       (256 * 1024)
+#define WRITER_BATCH_LATENCY_MS 50
+
+// written messages kept for reuse, the buffer a new one starts with
+// and the largest buffer they keep
+#define WORK_POOL_SIZE          4096
+#define WORK_MESSAGE_SIZE       256
+#define WORK_MESSAGE_MAX_SIZE   (16 * 1024)
 
 #define LL_DEBUG    "Debug"
 #define LL_INFO     "Info"
@@ -40,226 +75,1908 @@
 #endif
 
 
-vl::LogManager* vl::LogManager::self_ = nullptr;
+vl::LogManager* vl::LogManager::self_ = nullptr;
+
+
+namespace vl
+{
+    typedef std::shared_ptr<std::ostream> ostream_sptr;
+
+
+    namespace d_
+    {
+        struct Layout;
+
+        typedef std::vector<ostream_sptr> Streams;
+
+        // where a queued message goes: cout, cerr and the streams registered
+        // in a slot of the LogManager's SinkRegistry, 0 being no streams
+        enum Route
+        {
+            ROUTE_COUT       = 1u << 0,
+            ROUTE_CERR       = 1u << 1,
+            ROUTE_SLOT_SHIFT = 2
+        };
+
+        // queued message, taken from the LogManager's WorkPool and returned
+        // to it once written, so that its buffer is reused
+        struct Work
+        {
+            Work()
+                : level(nologging)
+                , route(0)
+                , msg()
+                , layout()
+                , format(nullptr)
+                , time(0)
+                , next(nullptr)
+            { }
+
+            unsigned int sink_slot() const { return route >> ROUTE_SLOT_SHIFT; }
+
+            LogLevel level;
+            unsigned int route;  // Route flags and slot
+            std::string msg;  // captured time, thread id and arguments while format is set
+
+            // deferred messages only, rendered by the writer thread
+            std::shared_ptr<const Layout> layout;
+            CapturedFormat format;
+
+            long long time;  // when it was queued in per_thread_queues mode, rings are merged by it
+            std::atomic<Work*> next;  // links the shared queue and the pool
+
+        private:
+            Work(const Work&);
+            Work& operator=(const Work&);
+        };
+
+
+        enum PatternOpType
+        {
+            PO_Text,      // slice of Pattern::text
+            PO_Time,      // slice of the TIMESTAMP_FORMAT text of the current second
+            PO_Millis,
+            PO_Level,
+            PO_Name,
+            PO_ThreadId
+        };
+
+        struct PatternOp
+        {
+            PatternOpType type;
+            size_t offset;  // text and time only
+            size_t size;
+        };
+
+        // pattern compiled into ops, those before message_pos make the prelude,
+        // the rest the epilog
+        struct Pattern
+        {
+            std::string text;
+            std::vector<PatternOp> ops;
+            size_t message_pos;
+            size_t epilog_max_size;  // without the newline
+        };
+
+        // returns false on unknown fields or more than one %v
+        bool compile_pattern(const std::string& pattern, size_t name_size, Pattern& result);
+
+        std::string default_pattern(unsigned int options);
+
+        // everything a message needs besides its body, shared with the queued
+        // deferred messages, so it is replaced rather than changed
+        struct Layout
+        {
+            std::string name;
+            Pattern program;
+            bool endl;
+        };
+
+        // replaces the captured data of a deferred message with its text, which
+        // is rendered into [scratch] and swapped with it to keep both buffers
+        void render_captured(Work& work, std::string& scratch);
+
+
+        struct ThreadRing
+        {
+            ThreadRing() : ring(), detached(false) { }
+
+            SpscRing<Work*, THREAD_RING_SIZE> ring;
+            std::atomic<bool> detached;  // set when the producer thread exits
+        };
+
+        // rings of producer threads in per_thread_queues mode, each thread
+        // registers its ring with its first message
+        struct ThreadRings
+        {
+            ThreadRings() : count(0) { }
+
+            ~ThreadRings()
+            {
+                for (ThreadRing* ring : rings)
+                    delete ring;
+            }
+
+            std::mutex lock;  // guards rings
+            std::vector<ThreadRing*> rings;
+            std::atomic<size_t> count;  // size of rings, read without the lock
+            std::vector<ThreadRing*> snapshot;  // writer thread only
+
+        private:
+            ThreadRings(const ThreadRings&);
+            ThreadRings& operator=(const ThreadRings&);
+        };
+
+
+        // streams of a logger and the slot they are registered in, streams are
+        // replaced rather than changed, so the slot stays valid while they are
+        struct SinkSetHandle
+        {
+            SinkSetHandle()
+                : streams(std::make_shared<Streams>())
+                , key(0)
+            { }
+
+            SinkSetHandle(const SinkSetHandle& other)
+                : streams(other.streams)
+                , key(other.key.load())
+            { }
+
+            SinkSetHandle& operator=(const SinkSetHandle& other)
+            {
+                streams = other.streams;
+                key.store(other.key.load());
+                return *this;
+            }
+
+            void reset(const std::shared_ptr<const Streams>& s)
+            {
+                streams = s;
+                key.store(0);
+            }
+
+            std::shared_ptr<const Streams> streams;
+            std::atomic<unsigned long long> key;  // LogManager generation << 32 | slot, 0 when not registered
+        };
+
+        /*
+         * Stream sets of loggers, so that a queued message refers to its streams by
+         * slot instead of carrying copies of their pointers. A set is released by
+         * the writer once no logger holds it and the messages queued before that
+         * have been written.
+         */
+        struct SinkRegistry
+        {
+            SinkRegistry()
+                : slots(1)
+                , version(0)
+                , snapshot(1)
+                , snapshot_version(0)
+            { }
+
+            // any thread, returns the slot of [streams]
+            unsigned int add(const std::shared_ptr<const Streams>& streams)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+
+                for (size_t i = 1; i < slots.size(); ++i)
+                {
+                    if (slots[i] == streams)
+                        return static_cast<unsigned int>(i);
+                }
+
+                unsigned int slot = static_cast<unsigned int>(slots.size());
+                if (!free_slots.empty())
+                {
+                    slot = free_slots.back();
+                    free_slots.pop_back();
+                    slots[slot] = streams;
+                }
+                else
+                {
+                    slots.push_back(streams);
+                }
+
+                version.fetch_add(1);
+                return slot;
+            }
+
+            // any thread, keeps the streams of [slot] alive after it is released
+            std::shared_ptr<const Streams> share(unsigned int slot)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                return slot < slots.size() ? slots[slot] : std::shared_ptr<const Streams>();
+            }
+
+            // writer thread only, nullptr for slot 0
+            const Streams* find(unsigned int slot)
+            {
+                if (snapshot_version != version.load())
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+
+                    snapshot.resize(slots.size());
+                    for (size_t i = 0; i < slots.size(); ++i)
+                        snapshot[i] = slots[i].get();
+                    snapshot_version = version.load();
+                }
+
+                return slot < snapshot.size() ? snapshot[slot] : nullptr;
+            }
+
+            // writer thread only, before draining the queues: sets held by no logger
+            // get no new messages, those already queued are written by the drain;
+            // nothing is collected while earlier sets still wait to be released
+            void collect_unused()
+            {
+                if (!unused.empty())
+                    return;
+
+                std::lock_guard<std::mutex> guard(lock);
+
+                for (size_t i = 1; i < slots.size(); ++i)
+                {
+                    if (slots[i] && slots[i].use_count() == 1)
+                        unused.push_back(static_cast<unsigned int>(i));
+                }
+
+                // pairs with the release of the last reference, which a logging
+                // thread drops only after its message is queued
+                std::atomic_thread_fence(std::memory_order_acquire);
+            }
+
+            // writer thread only, once a drain has left the queues empty, so no
+            // message of the collected sets can be left in them
+            void release_unused()
+            {
+                if (unused.empty())
+                    return;
+
+                std::lock_guard<std::mutex> guard(lock);
+
+                for (unsigned int slot : unused)
+                {
+                    slots[slot].reset();
+                    free_slots.push_back(slot);
+                }
+
+                unused.clear();
+                version.fetch_add(1);
+            }
+
+            std::mutex lock;  // guards slots and free_slots
+            std::vector<std::shared_ptr<const Streams> > slots;
+            std::vector<unsigned int> free_slots;
+            std::atomic<unsigned int> version;  // changes with slots
+
+            // writer thread only
+            std::vector<const Streams*> snapshot;
+            unsigned int snapshot_version;
+            std::vector<unsigned int> unused;
+
+        private:
+            SinkRegistry(const SinkRegistry&);
+            SinkRegistry& operator=(const SinkRegistry&);
+        };
+
+
+        // room left in the queue according to QueueLimits and messages dropped
+        // for the lack of it; messages are only counted when there are limits
+        struct QueueBudget
+        {
+            QueueBudget(const QueueLimits& l, SinkRegistry& s)
+                : limits(l)
+                , sinks(s)
+                , queued_messages(0)
+                , queued_bytes(0)
+                , dropped(0)
+                , report_route(0)
+                , report_streams()
+            { }
+
+            bool bounded() const
+            {
+                return limits.max_messages != 0 || limits.max_bytes != 0;
+            }
+
+            // a message always fits into an empty queue, however big it is
+            bool reserve(size_t size)
+            {
+                size_t messages = queued_messages.fetch_add(1) + 1;
+                size_t bytes = queued_bytes.fetch_add(size) + size;
+
+                if (messages == 1
+                    || ((limits.max_messages == 0 || messages <= limits.max_messages)
+                        && (limits.max_bytes == 0 || bytes <= limits.max_bytes)))
+                    return true;
+
+                release(size);
+                return false;
+            }
+
+            void release(size_t size, size_t messages = 1)
+            {
+                if (!bounded())
+                    return;
+
+                queued_messages.fetch_sub(messages);
+                queued_bytes.fetch_sub(size);
+            }
+
+            // keeps the sinks of the last dropped message to report to, its
+            // slot may be released before the report is written
+            void drop(const Work& work)
+            {
+                std::shared_ptr<const Streams> streams = sinks.share(work.sink_slot());
+
+                std::lock_guard<std::mutex> lock(report_lock);
+                report_route = work.route;
+                report_streams.swap(streams);
+                dropped.fetch_add(1);
+            }
+
+            // false if nothing was dropped since the last report
+            bool take_report(Work& result, std::shared_ptr<const Streams>& streams)
+            {
+                if (dropped.load() == 0)
+                    return false;
+
+                std::lock_guard<std::mutex> lock(report_lock);
+                result.route = report_route;
+                streams.swap(report_streams);
+                report_streams.reset();
+                result.msg.clear();
+                safe_sprintf(result.msg, "VariadicLogger: {0} messages dropped, log queue was full\n", dropped.exchange(0));
+                return true;
+            }
+
+            const QueueLimits limits;
+            SinkRegistry& sinks;
+            std::atomic<size_t> queued_messages;
+            std::atomic<size_t> queued_bytes;
+            std::mutex evict_lock;  // drop_oldest only, serializes taking messages off the queues
+
+        private:
+            QueueBudget(const QueueBudget&);
+            QueueBudget& operator=(const QueueBudget&);
+
+            std::atomic<size_t> dropped;
+            std::mutex report_lock;  // guards report_route and report_streams
+            unsigned int report_route;
+            std::shared_ptr<const Streams> report_streams;
+        };
+
+
+        // deletes a chain of messages linked by Work::next
+        inline void delete_works(Work* work)
+        {
+            while (work != nullptr)
+            {
+                Work* next = work->next.load(std::memory_order_relaxed);
+                delete work;
+                work = next;
+            }
+        }
+
+        /*
+         * Written messages on their way back to the logging threads. The writer
+         * (or a thread evicting with drop_oldest) pushes them one by one and a
+         * logging thread takes them all at once into its own cache, so there is
+         * no ABA problem. Only up to WORK_POOL_SIZE of them are kept.
+         */
+        struct WorkPool
+        {
+            WorkPool()
+                : returned(nullptr)
+                , size(0)
+            { }
+
+            ~WorkPool()
+            {
+                delete_works(returned.load());
+            }
+
+            // any thread
+            void give_back(Work* work)
+            {
+                if (size.load(std::memory_order_relaxed) >= WORK_POOL_SIZE
+                    || work->msg.capacity() > WORK_MESSAGE_MAX_SIZE)
+                {
+                    delete work;
+                    return;
+                }
+
+                work->msg.clear();
+                work->layout.reset();
+                work->format = nullptr;
+
+                Work* head = returned.load(std::memory_order_relaxed);
+                do
+                {
+                    work->next.store(head, std::memory_order_relaxed);
+                }
+                while (!returned.compare_exchange_weak(head, work, std::memory_order_release,
+                                                       std::memory_order_relaxed));
+                size.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            // any thread, nullptr when there is nothing to reuse
+            Work* take_all()
+            {
+                if (returned.load(std::memory_order_relaxed) == nullptr)
+                    return nullptr;
+
+                Work* works = returned.exchange(nullptr, std::memory_order_acquire);
+                size.store(0, std::memory_order_relaxed);  // only roughly, it just bounds the pool
+                return works;
+            }
+
+            std::atomic<Work*> returned;
+            std::atomic<size_t> size;
+
+        private:
+            WorkPool(const WorkPool&);
+            WorkPool& operator=(const WorkPool&);
+        };
+    }
+
+
+    // mutex is only needed for immediate output to synchronize access to streams
+    // when logging is done from worker thread, it is done only in one thread and
+    // don't need logging
+    template <typename T>
+    struct LoggerImplMutex;
+
+    template <>
+    struct LoggerImplMutex<vl::delegate> {};
+
+    template <>
+    struct LoggerImplMutex<vl::immediate>
+    {
+        LoggerImplMutex()
+            : mutex(new std::mutex)
+        { }
+
+        std::shared_ptr<std::mutex> mutex;
+    };
+
+
+    template <typename T>
+    struct LoggerT<T>::Impl : LoggerImplMutex<T>
+    {
+        Impl(const std::string& name) :
+            name         (name),
+            sinks        (),
+            cout_level   (nologging),
+            cerr_level   (nologging),
+            streams_level(nologging),
+            options      (usual),
+            pattern      (),
+            layout       ()
+        {
+            compile();
+        }
+
+        // rebuilds the layout after the pattern or the options change
+        void compile()
+        {
+            std::shared_ptr<d_::Layout> compiled_layout(new d_::Layout);
+            compiled_layout->name = name;
+            compiled_layout->endl = (options & noendl) == 0;
+
+            bool compiled = d_::compile_pattern(pattern.empty() ? d_::default_pattern(options) : pattern,
+                                                name.size(), compiled_layout->program);
+            assert(compiled && "Invalid log message pattern");
+            (void)compiled;
+
+            layout = compiled_layout;
+        }
+
+        std::string                    name;
+        d_::SinkSetHandle              sinks;
+        LogLevel                       cout_level;
+        LogLevel                       cerr_level;
+        LogLevel                       streams_level;
+        unsigned int                   options;  // LogOpts flags
+        std::string                    pattern;  // empty for the default layout
+        std::shared_ptr<const d_::Layout> layout;
+    };
+
+
+    struct LogManager::Impl
+    {
+        explicit Impl(const QueueLimits& limits)
+            : sinks_()
+            , budget_(limits, sinks_)
+        { }
+
+        std::mutex lock_;  // guards loggers_
+        std::map<std::string, vl::Logger> loggers_;
+        std::atomic<bool> is_running_;
+        std::thread writer_thread_;
+        IntrusiveMpscQueue<d_::Work> msg_queue_;
+        d_::WorkPool pool_;
+        vl::Doorbell new_msgs_bell_;
+        QueueMode mode_;
+        WriterMode writers_;
+        d_::ThreadRings thread_rings_;
+        unsigned int generation_;  // tells rings and sink slots of this manager from earlier ones
+        d_::SinkRegistry sinks_;
+        d_::QueueBudget budget_;
+    };
+}
+
+
+namespace
+{
+    std::atomic<unsigned int> last_generation(0);
+    std::atomic<unsigned int> active_generation(0);  // 0 without a LogManager
+}
+
+
+vl::LogManager::LogManager(QueueMode mode, const QueueLimits& limits, WriterMode writers)
+    : d(new Impl(limits))
+{
+    if (self_ != nullptr)
+        throw std::runtime_error("LogManager already created");
+
+    d->mode_ = mode;
+    d->writers_ = writers;
+    d->generation_ = ++last_generation;
+    active_generation.store(d->generation_);
+
+    self_ = this;
+    d->is_running_.store(true);
+    d->writer_thread_ = std::thread(&vl::LogManager::writer_loop, this);
+}
+
+
+vl::LogManager::~LogManager()
+{
+    self_ = nullptr;  // prevents queueing new messages
+    active_generation.store(0);
+
+    d->is_running_.store(false);  // ensures that loop is not entered again
+    d->new_msgs_bell_.ring();  // unblocks the loop and signals to process any left messages
+
+    if (d->writer_thread_.joinable())
+        d->writer_thread_.join();
+
+    delete d;
+}
+
+
+namespace
+{
+    struct RingHandle
+    {
+        vl::d_::ThreadRing* ring;
+        unsigned int generation;
+    };
+
+    // messages this thread took from the pool, dropped when the LogManager is recreated
+    struct WorkCache
+    {
+        vl::d_::Work* works;
+        unsigned int generation;
+    };
+
+#ifdef VL_THREAD_LOCAL_OBJECTS_SUPPORTED
+
+    // detaches the ring when its thread exits, so the writer frees it once drained
+    struct RingOwner
+    {
+        RingOwner() : handle() { }
+
+        ~RingOwner()
+        {
+            if (handle.ring != nullptr && handle.generation == active_generation.load())
+                handle.ring->detached.store(true);
+        }
+
+        RingHandle handle;
+    };
+
+    thread_local RingOwner ring_owner;
+
+    RingHandle& thread_ring_handle() { return ring_owner.handle; }
+
+    // the cached messages are only referred to by their thread
+    struct WorkCacheOwner
+    {
+        WorkCacheOwner() : cache() { }
+        ~WorkCacheOwner() { vl::d_::delete_works(cache.works); }
+
+        WorkCache cache;
+    };
+
+    thread_local WorkCacheOwner work_cache_owner;
+
+    WorkCache& thread_work_cache() { return work_cache_owner.cache; }
+
+#else
+
+    // rings of exited threads stay registered until the LogManager is destroyed
+    VL_THREAD_LOCAL RingHandle ring_handle;
+
+    RingHandle& thread_ring_handle() { return ring_handle; }
+
+    // cached messages of exited threads are leaked
+    VL_THREAD_LOCAL WorkCache work_cache;
+
+    WorkCache& thread_work_cache() { return work_cache; }
+
+#endif
+
+    // gives the writer thread a chance to make room, waking it in case it waits
+    void wait_for_writer(vl::Doorbell& new_msgs_bell, unsigned int attempt)
+    {
+        new_msgs_bell.ring();
+
+        if (attempt < 64)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+
+    // applies the overflow policy until the message fits within the limits,
+    // [evict_oldest] drops one queued message and returns false if there is none;
+    // returns false if the message itself was dropped, it is not given back here
+    template <typename Evict>
+    bool make_room(vl::d_::QueueBudget& budget, vl::d_::Work& work, Evict evict_oldest, vl::Doorbell& new_msgs_bell)
+    {
+        if (!budget.bounded())
+            return true;
+
+        size_t size = work.msg.size();
+
+        for (unsigned int attempt = 0; !budget.reserve(size); ++attempt)
+        {
+            switch (budget.limits.policy)
+            {
+            case vl::drop_newest:
+                budget.drop(work);
+                return false;
+
+            case vl::drop_below_level:
+                if (work.level < budget.limits.drop_level)
+                {
+                    budget.drop(work);
+                    return false;
+                }
+                wait_for_writer(new_msgs_bell, attempt);
+                break;
+
+            case vl::drop_oldest:
+                // nothing left to evict, the rest is being written or waits in sink lanes
+                if (!evict_oldest())
+                {
+                    budget.drop(work);
+                    return false;
+                }
+                break;
+
+            case vl::block_producer:
+            default:
+                wait_for_writer(new_msgs_bell, attempt);
+                break;
+            }
+        }
+
+        return true;
+    }
+
+
+    void push_to_shared_queue(vl::IntrusiveMpscQueue<vl::d_::Work>& queue, vl::d_::QueueBudget& budget,
+                              vl::d_::WorkPool& pool, vl::d_::Work* work, vl::Doorbell& new_msgs_bell)
+    {
+        // the dropped message's sink slot is looked up under the lock, the
+        // writer releases unused slots only under it
+        auto evict_oldest = [&]() -> bool {
+            vl::d_::Work* oldest;
+            {
+                std::lock_guard<std::mutex> lock(budget.evict_lock);
+                oldest = queue.pop();
+
+                if (oldest == nullptr)
+                    return false;
+
+                budget.release(oldest->msg.size());
+                budget.drop(*oldest);
+            }
+
+            pool.give_back(oldest);
+            return true;
+        };
+
+        if (make_room(budget, *work, evict_oldest, new_msgs_bell))
+            queue.push(work);
+        else
+            pool.give_back(work);
+    }
+
+
+    void push_to_thread_ring(vl::d_::ThreadRings& rings, unsigned int generation, vl::d_::QueueBudget& budget,
+                             vl::d_::WorkPool& pool, vl::d_::Work* work, vl::Doorbell& new_msgs_bell)
+    {
+        RingHandle& handle = thread_ring_handle();
+
+        // first message of this thread or first one since the LogManager was recreated
+        if (handle.ring == nullptr || handle.generation != generation)
+        {
+            std::unique_ptr<vl::d_::ThreadRing> ring(new vl::d_::ThreadRing);
+            std::lock_guard<std::mutex> lock(rings.lock);
+            rings.rings.push_back(ring.get());
+            rings.count.store(rings.rings.size());
+
+            handle.ring = ring.release();
+            handle.generation = generation;
+        }
+
+        vl::d_::ThreadRing* ring = handle.ring;
+
+        // only this thread's messages can be evicted, the writer merges the other rings
+        auto evict_oldest = [&]() -> bool {
+            std::unique_lock<std::mutex> lock(budget.evict_lock);
+
+            if (ring->ring.empty())
+                return false;
+
+            vl::d_::Work* oldest = ring->ring.front();
+            ring->ring.pop();
+
+            budget.release(oldest->msg.size());
+            budget.drop(*oldest);
+            lock.unlock();
+
+            pool.give_back(oldest);
+            return true;
+        };
+
+        if (!make_room(budget, *work, evict_oldest, new_msgs_bell))
+        {
+            pool.give_back(work);
+            return;
+        }
+
+        work->time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now().time_since_epoch()).count();
+
+        // full ring, handled like a full queue
+        for (unsigned int attempt = 0; !ring->ring.push(std::move(work)); ++attempt)
+        {
+            vl::OverflowPolicy policy = budget.limits.policy;
+
+            if (policy == vl::drop_newest
+                || (policy == vl::drop_below_level && work->level < budget.limits.drop_level))
+            {
+                budget.release(work->msg.size());
+                budget.drop(*work);
+                pool.give_back(work);
+                return;
+            }
+
+            if (policy != vl::drop_oldest || !evict_oldest())
+                wait_for_writer(new_msgs_bell, attempt);
+        }
+    }
+}
+
+
+vl::d_::Work* vl::d_::acquire_work()
+{
+    if (!LogManager::self_)
+    {
+        throw std::runtime_error("Trying to log messages without valid LogManager");
+    }
+
+    LogManager::Impl* d = LogManager::self_->d;
+    WorkCache& cache = thread_work_cache();
+
+    if (cache.generation != d->generation_)
+    {
+        delete_works(cache.works);
+        cache.works = nullptr;
+        cache.generation = d->generation_;
+    }
+
+    if (cache.works == nullptr)
+        cache.works = d->pool_.take_all();
+
+    // only until enough messages circulate between this thread and the writer
+    if (cache.works == nullptr)
+    {
+        std::unique_ptr<Work> work(new Work);
+        work->msg.reserve(WORK_MESSAGE_SIZE);
+        return work.release();
+    }
+
+    Work* work = cache.works;
+    cache.works = work->next.load(std::memory_order_relaxed);
+    return work;
+}
+
+
+void vl::d_::queue_work(d_::Work* work)
+{
+    if (!LogManager::self_)
+    {
+        delete work;
+        throw std::runtime_error("Trying to log messages without valid LogManager");
+    }
+
+    LogManager::Impl* d = LogManager::self_->d;
+
+    // no lock, producers only contend on the queue's atomic exchange
+    // or touch nothing shared at all with their own rings
+    if (d->mode_ == per_thread_queues)
+        push_to_thread_ring(d->thread_rings_, d->generation_, d->budget_, d->pool_, work, d->new_msgs_bell_);
+    else
+        push_to_shared_queue(d->msg_queue_, d->budget_, d->pool_, work, d->new_msgs_bell_);
+
+    d->new_msgs_bell_.ring();
+}
+
+
+unsigned int vl::d_::sink_slot(SinkSetHandle& handle)
+{
+    if (!LogManager::self_)
+    {
+        throw std::runtime_error("Trying to log messages without valid LogManager");
+    }
+
+    LogManager::Impl* d = LogManager::self_->d;
+    unsigned long long key = handle.key.load();
+
+    if (static_cast<unsigned int>(key >> 32) == d->generation_)
+        return static_cast<unsigned int>(key);
+
+    // first message since the streams changed or the LogManager was recreated
+    unsigned int slot = d->sinks_.add(handle.streams);
+    handle.key.store(static_cast<unsigned long long>(d->generation_) << 32 | slot);
+    return slot;
+}
+
+
+namespace
+{
+    // where the writer thread puts the messages it takes off the queues
+    class MessageWriter
+    {
+    public:
+        explicit MessageWriter(vl::d_::SinkRegistry& sinks)
+            : registry_(sinks)
+            , scratch_()
+        { }
+
+        virtual ~MessageWriter() { }
+
+        void add(vl::d_::Work& work)
+        {
+            add(work, registry_.find(work.sink_slot()), true);
+        }
+
+        // messages not taken off the queues do not release any room
+        virtual void add(vl::d_::Work& work, const vl::d_::Streams* streams, bool queued) = 0;
+
+        // true when messages should be written before taking more
+        virtual bool full() const = 0;
+
+        // after every drain of the queues
+        virtual void write() = 0;
+
+    protected:
+        // text of a deferred message, rendered with a buffer this writer keeps
+        void render(vl::d_::Work& work)
+        {
+            if (work.format != nullptr)
+                vl::d_::render_captured(work, scratch_);
+        }
+
+    private:
+        MessageWriter(const MessageWriter&);
+        MessageWriter& operator=(const MessageWriter&);
+
+        vl::d_::SinkRegistry& registry_;
+        std::string scratch_;
+    };
+
+
+    /*
+     * Messages taken off the queues, gathered per sink and written with one
+     * write and one flush per sink. Written when the queues are drained or the
+     * batch grows beyond WRITER_BATCH_SIZE bytes or WRITER_BATCH_LATENCY_MS.
+     * Their room in the queue budget is released once they are written.
+     */
+    class WriteBatch : public MessageWriter
+    {
+    public:
+        WriteBatch(vl::d_::QueueBudget& budget, vl::d_::SinkRegistry& sinks)
+            : MessageWriter(sinks)
+            , budget_(budget)
+            , sinks_()
+            , used_(0)
+            , messages_(0)
+            , bytes_(0)
+            , queued_bytes_(0)
+            , started_()
+        { }
+
+        using MessageWriter::add;
+
+        virtual void add(vl::d_::Work& work, const vl::d_::Streams* streams, bool queued)
+        {
+            if (queued)
+            {
+                ++messages_;
+                queued_bytes_ += work.msg.size();
+            }
+
+            render(work);
+
+            if (bytes_ == 0)
+                started_ = std::chrono::steady_clock::now();
+
+            if (work.route & vl::d_::ROUTE_COUT)
+                append(&std::cout, nullptr, work.msg);
+            if (work.route & vl::d_::ROUTE_CERR)
+                append(&std::cerr, nullptr, work.msg);
+            if (streams != nullptr)
+            {
+                for (const vl::ostream_sptr& stream : *streams)
+                    append(stream.get(), &stream, work.msg);
+            }
+        }
+
+        virtual bool full() const
+        {
+            return bytes_ >= WRITER_BATCH_SIZE
+                || std::chrono::steady_clock::now() - started_ >= std::chrono::milliseconds(WRITER_BATCH_LATENCY_MS);
+        }
+
+        virtual void write()
+        {
+            for (size_t i = 0; i < used_; ++i)
+            {
+                Sink& sink = sinks_[i];
+                sink.stream->write(sink.text.data(), static_cast<std::streamsize>(sink.text.size()));
+                sink.stream->flush();
+
+                // keeps the capacity, but not the stream alive
+                sink.text.clear();
+                sink.owner.reset();
+            }
+
+            budget_.release(queued_bytes_, messages_);
+
+            used_ = 0;
+            messages_ = 0;
+            bytes_ = 0;
+            queued_bytes_ = 0;
+        }
+
+    private:
+        struct Sink
+        {
+            std::ostream* stream;
+            vl::ostream_sptr owner;  // empty for cout and cerr
+            std::string text;
+        };
+
+        // there are only a few sinks, so they are looked up linearly
+        void append(std::ostream* stream, const vl::ostream_sptr* owner, const std::string& msg)
+        {
+            size_t i = 0;
+            while (i < used_ && sinks_[i].stream != stream)
+                ++i;
+
+            if (i == used_)
+            {
+                if (used_ == sinks_.size())
+                    sinks_.push_back(Sink());
+
+                sinks_[i].stream = stream;
+                if (owner != nullptr)
+                    sinks_[i].owner = *owner;
+                ++used_;
+            }
+
+            sinks_[i].text.append(msg);
+            bytes_ += msg.size();
+        }
+
+        vl::d_::QueueBudget& budget_;
+        std::vector<Sink> sinks_;  // first used_ ones belong to the current batch
+        size_t used_;
+        size_t messages_;
+        size_t bytes_;
+        size_t queued_bytes_;
+        std::chrono::steady_clock::time_point started_;
+    };
+
+
+    // formatted message shared by the lanes of all its sinks, the last one
+    // to write it releases its room in the queue budget
+    struct SharedMessage
+    {
+        SharedMessage()
+            : text()
+            , queued_size(0)
+            , pending(0)
+            , next(nullptr)
+        { }
+
+        std::string text;
+        size_t queued_size;  // 0 for messages that were not queued
+        std::atomic<size_t> pending;
+        SharedMessage* next;  // in SharedMessagePool
+    };
+
+    /*
+     * Written shared messages kept for reuse, like vl::d_::WorkPool: the lanes
+     * push them one by one, the dispatching writer thread takes them all at
+     * once. Their buffers are swapped with those of the queued messages, so
+     * both pools keep their capacity.
+     */
+    class SharedMessagePool
+    {
+    public:
+        SharedMessagePool()
+            : returned_(nullptr)
+            , size_(0)
+            , free_(nullptr)
+        { }
+
+        ~SharedMessagePool()
+        {
+            delete_messages(returned_.load());
+            delete_messages(free_);
+        }
+
+        // dispatching writer thread only
+        SharedMessage* acquire()
+        {
+            if (free_ == nullptr && returned_.load(std::memory_order_relaxed) != nullptr)
+            {
+                free_ = returned_.exchange(nullptr, std::memory_order_acquire);
+                size_.store(0, std::memory_order_relaxed);  // only roughly, it just bounds the pool
+            }
+
+            // the buffer goes back with the message it is swapped with
+            if (free_ == nullptr)
+            {
+                std::unique_ptr<SharedMessage> msg(new SharedMessage);
+                msg->text.reserve(WORK_MESSAGE_SIZE);
+                return msg.release();
+            }
+
+            SharedMessage* msg = free_;
+            free_ = msg->next;
+            return msg;
+        }
+
+        // lane threads
+        void give_back(SharedMessage* msg)
+        {
+            if (size_.load(std::memory_order_relaxed) >= WORK_POOL_SIZE
+                || msg->text.capacity() > WORK_MESSAGE_MAX_SIZE)
+            {
+                delete msg;
+                return;
+            }
+
+            msg->text.clear();
+
+            SharedMessage* head = returned_.load(std::memory_order_relaxed);
+            do
+            {
+                msg->next = head;
+            }
+            while (!returned_.compare_exchange_weak(head, msg, std::memory_order_release,
+                                                    std::memory_order_relaxed));
+            size_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+    private:
+        SharedMessagePool(const SharedMessagePool&);
+        SharedMessagePool& operator=(const SharedMessagePool&);
+
+        static void delete_messages(SharedMessage* msg)
+        {
+            while (msg != nullptr)
+            {
+                SharedMessage* next = msg->next;
+                delete msg;
+                msg = next;
+            }
+        }
+
+        std::atomic<SharedMessage*> returned_;
+        std::atomic<size_t> size_;
+        SharedMessage* free_;  // taken from returned_ by the writer thread
+    };
+
+    void release_message(SharedMessage* msg, vl::d_::QueueBudget& budget, SharedMessagePool& pool)
+    {
+        if (msg->pending.fetch_sub(1) != 1)
+            return;
+
+        if (msg->queued_size != 0)
+            budget.release(msg->queued_size);
+        pool.give_back(msg);
+    }
+
+
+    // writer thread of one sink with its own queue, writes what is queued
+    // with one write and one flush
+    class SinkLane
+    {
+    public:
+        SinkLane(std::ostream* stream, const vl::ostream_sptr* owner, vl::d_::QueueBudget& budget,
+                 SharedMessagePool& pool)
+            : stream_(stream)
+            , owner_(owner != nullptr ? *owner : vl::ostream_sptr())
+            , budget_(budget)
+            , pool_(pool)
+            , queue_()
+            , doorbell_()
+            , running_(true)
+            , finished_(false)
+            , thread_()
+        {
+            thread_ = std::thread(&SinkLane::run, this);
+        }
+
+        // writes what is queued before stopping, join() after finished()
+        void stop()
+        {
+            running_.store(false);
+            doorbell_.ring();
+        }
+
+        bool finished() const { return finished_.load(); }
+
+        void join()
+        {
+            if (thread_.joinable())
+                thread_.join();
+        }
+
+        void push(SharedMessage* msg)
+        {
+            queue_.push(std::move(msg));
+            doorbell_.ring();
+        }
+
+        std::ostream* stream() const { return stream_; }
+
+        // no logger refers to the stream any more, cout and cerr are always referred to
+        bool unused() const { return owner_ && owner_.use_count() == 1; }
+
+    private:
+        SinkLane(const SinkLane&);
+        SinkLane& operator=(const SinkLane&);
+
+        void run()
+        {
+            std::string text;
+            std::vector<SharedMessage*> written;
+
+            for (;;)
+            {
+                doorbell_.wait_for([&]{ return !running_.load() || !queue_.empty(); },
+                                   std::chrono::seconds(1));
+                bool running = running_.load();
+
+                queue_.consume_all([&](SharedMessage* msg) {
+                    text.append(msg->text);
+                    written.push_back(msg);
+
+                    if (text.size() >= WRITER_BATCH_SIZE)
+                        write(text, written);
+                });
+                write(text, written);
+
+                if (!running && queue_.empty())
+                    break;
+            }
+
+            finished_.store(true);
+        }
+
+        void write(std::string& text, std::vector<SharedMessage*>& written)
+        {
+            if (!text.empty())
+            {
+                stream_->write(text.data(), static_cast<std::streamsize>(text.size()));
+                stream_->flush();
+                text.clear();
+            }
+
+            for (SharedMessage* msg : written)
+                release_message(msg, budget_, pool_);
+            written.clear();
+        }
+
+        std::ostream* stream_;
+        vl::ostream_sptr owner_;  // empty for cout and cerr
+        vl::d_::QueueBudget& budget_;
+        SharedMessagePool& pool_;
+        vl::MpscQueue<SharedMessage*> queue_;  // single producer, the dispatching writer thread
+        vl::Doorbell doorbell_;
+        std::atomic<bool> running_;
+        std::atomic<bool> finished_;
+        std::thread thread_;
+    };
+
+
+    /*
+     * Hands messages to a lane per sink, so a stalled sink holds up only its
+     * own lane. Lanes are started with the first message for their sink and
+     * stopped once no logger refers to it.
+     */
+    class SinkLanes : public MessageWriter
+    {
+    public:
+        SinkLanes(vl::d_::QueueBudget& budget, vl::d_::SinkRegistry& sinks)
+            : MessageWriter(sinks)
+            , budget_(budget)
+            , pool_()
+            , lanes_()
+            , stopping_()
+            , targets_()
+        { }
+
+        // each lane writes what it has queued before its thread ends
+        ~SinkLanes()
+        {
+            for (SinkLane* lane : lanes_)
+                lane->stop();
+
+            lanes_.insert(lanes_.end(), stopping_.begin(), stopping_.end());
+
+            for (SinkLane* lane : lanes_)
+            {
+                lane->join();
+                delete lane;
+            }
+        }
+
+        using MessageWriter::add;
+
+        virtual void add(vl::d_::Work& work, const vl::d_::Streams* streams, bool queued)
+        {
+            size_t queued_size = queued ? work.msg.size() : 0;
+
+            render(work);
+
+            targets_.clear();
+            if (work.route & vl::d_::ROUTE_COUT)
+                targets_.push_back(lane(&std::cout, nullptr));
+            if (work.route & vl::d_::ROUTE_CERR)
+                targets_.push_back(lane(&std::cerr, nullptr));
+            if (streams != nullptr)
+            {
+                for (const vl::ostream_sptr& stream : *streams)
+                    targets_.push_back(lane(stream.get(), &stream));
+            }
+
+            if (targets_.empty())
+            {
+                if (queued_size != 0)
+                    budget_.release(queued_size);
+                return;
+            }
+
+            SharedMessage* msg = pool_.acquire();
+            msg->text.swap(work.msg);
+            msg->queued_size = queued_size;
+            msg->pending.store(targets_.size());
+            for (SinkLane* target : targets_)
+                target->push(msg);
+        }
+
+        virtual bool full() const { return false; }
+
+        virtual void write()
+        {
+            // lanes write on their own, only retire those of released streams
+            for (size_t i = 0; i < lanes_.size(); )
+            {
+                if (lanes_[i]->unused())
+                {
+                    lanes_[i]->stop();
+                    stopping_.push_back(lanes_[i]);
+                    lanes_.erase(lanes_.begin() + i);
+                }
+                else
+                {
+                    ++i;
+                }
+            }
+
+            for (size_t i = 0; i < stopping_.size(); )
+            {
+                if (stopping_[i]->finished())
+                {
+                    stopping_[i]->join();
+                    delete stopping_[i];
+                    stopping_.erase(stopping_.begin() + i);
+                }
+                else
+                {
+                    ++i;
+                }
+            }
+        }
+
+    private:
+        // there are only a few sinks, so they are looked up linearly
+        SinkLane* lane(std::ostream* stream, const vl::ostream_sptr* owner)
+        {
+            for (SinkLane* existing : lanes_)
+            {
+                if (existing->stream() == stream)
+                    return existing;
+            }
+
+            lanes_.push_back(new SinkLane(stream, owner, budget_, pool_));
+            return lanes_.back();
+        }
+
+        vl::d_::QueueBudget& budget_;
+        SharedMessagePool pool_;  // outlives the lanes, they are joined by the destructor
+        std::vector<SinkLane*> lanes_;
+        std::vector<SinkLane*> stopping_;  // lanes writing what is left before their thread ends
+        std::vector<SinkLane*> targets_;
+    };
+}
+
+
+namespace
+{
+    // the batch keeps a copy of the text, so the message goes back to the pool
+    void add_to_batch(MessageWriter& batch, vl::d_::WorkPool& pool, vl::d_::Work* work)
+    {
+        batch.add(*work);
+        pool.give_back(work);
+
+        if (batch.full())
+            batch.write();
+    }
+
+
+    void drain_shared_queue(vl::IntrusiveMpscQueue<vl::d_::Work>& queue, vl::d_::QueueBudget& budget,
+                            vl::d_::WorkPool& pool, MessageWriter& batch)
+    {
+        // producers evict messages concurrently with drop_oldest, take each
+        // one under the lock but write it without
+        std::unique_lock<std::mutex> lock(budget.evict_lock, std::defer_lock);
+        bool evicting = budget.limits.policy == vl::drop_oldest;
+
+        for (;;)
+        {
+            if (evicting)
+                lock.lock();
+
+            vl::d_::Work* work = queue.pop();
+
+            if (evicting)
+                lock.unlock();
+
+            if (work == nullptr)
+                break;
+
+            add_to_batch(batch, pool, work);
+        }
+    }
+
+
+    // writes what is queued in all rings, earliest first; messages queued by
+    // different threads at nearly the same time may still come out of order
+    // when one of them becomes visible only after the other was written
+    void drain_thread_rings(vl::d_::ThreadRings& rings, vl::d_::QueueBudget& budget,
+                            vl::d_::WorkPool& pool, MessageWriter& batch)
+    {
+        {
+            std::lock_guard<std::mutex> lock(rings.lock);
+
+            // the owner's last push happened before detaching, so empty is final
+            auto finished = std::remove_if(rings.rings.begin(), rings.rings.end(), [](vl::d_::ThreadRing* ring) {
+                if (!ring->detached.load() || !ring->ring.empty())
+                    return false;
+                delete ring;
+                return true;
+            });
+            rings.rings.erase(finished, rings.rings.end());
+            rings.count.store(rings.rings.size());
+
+            rings.snapshot = rings.rings;
+        }
+
+        bool evicting = budget.limits.policy == vl::drop_oldest;
+
+        for (;;)
+        {
+            vl::d_::Work* work;
+
+            {
+                // producers evict from their own rings with drop_oldest
+                std::unique_lock<std::mutex> lock(budget.evict_lock, std::defer_lock);
+                if (evicting)
+                    lock.lock();
+
+                vl::d_::ThreadRing* earliest = nullptr;
+
+                for (vl::d_::ThreadRing* ring : rings.snapshot)
+                {
+                    if (!ring->ring.empty()
+                        && (earliest == nullptr || ring->ring.front()->time < earliest->ring.front()->time))
+                        earliest = ring;
+                }
+
+                if (earliest == nullptr)
+                    break;
+
+                work = earliest->ring.front();
+                earliest->ring.pop();
+            }
+
+            add_to_batch(batch, pool, work);
+        }
+    }
+
+    // writer thread only, polled while it spins, so the lock is not taken;
+    // rings registered since the last drain are not in the snapshot yet, but
+    // only the writer removes rings, so they show as a larger count
+    bool thread_rings_empty(vl::d_::ThreadRings& rings)
+    {
+        if (rings.count.load() != rings.snapshot.size())
+            return false;
+
+        for (vl::d_::ThreadRing* ring : rings.snapshot)
+        {
+            if (!ring->ring.empty())
+                return false;
+        }
+
+        return true;
+    }
+}
+
+
+void vl::LogManager::writer_loop()
+{
+    std::unique_ptr<MessageWriter> output;
+    if (d->writers_ == writer_per_sink)
+        output.reset(new SinkLanes(d->budget_, d->sinks_));
+    else
+        output.reset(new WriteBatch(d->budget_, d->sinks_));
+    MessageWriter& batch = *output;
+
+    for (;;)
+    {
+        // spins, then parks until a producer that pushed after the queues
+        // were seen empty rings the doorbell (both sides use sequentially
+        // consistent atomics)
+        d->new_msgs_bell_.wait_for([&]{
+            return !d->is_running_.load() || !d->msg_queue_.empty() || !thread_rings_empty(d->thread_rings_);
+        }, std::chrono::seconds(1));
+        bool running = d->is_running_.load();
+
+        d->sinks_.collect_unused();
+
+        drain_shared_queue(d->msg_queue_, d->budget_, d->pool_, batch);
+        drain_thread_rings(d->thread_rings_, d->budget_, d->pool_, batch);
+
+        bool drained = d->msg_queue_.empty() && thread_rings_empty(d->thread_rings_);
+
+        // pressure is off, tell how many messages were lost meanwhile
+        vl::d_::Work report;
+        std::shared_ptr<const vl::d_::Streams> report_streams;
+        if (drained && d->budget_.take_report(report, report_streams))
+            batch.add(report, report_streams.get(), false);
+
+        batch.write();
+
+        // a push still in progress may hide messages of the collected sets,
+        // they are released after a later drain then; with drop_oldest a
+        // producer may have taken the last of them off the queues and still
+        // be looking up its sinks for the drop report
+        if (drained)
+        {
+            std::unique_lock<std::mutex> lock(d->budget_.evict_lock, std::defer_lock);
+            if (d->budget_.limits.policy == vl::drop_oldest)
+                lock.lock();
+            d->sinks_.release_unused();
+        }
+
+        // after shutdown, keep going until pushes in progress have completed
+        if (!running && drained)
+            break;
+    }
+}
+
+
+vl::Logger vl::get_logger(const std::string& name)
+{
+    if (!LogManager::self_)
+    {
+        throw std::runtime_error("Trying to get logger without valid LogManager");
+    }
+
+    std::lock_guard<std::mutex> lock(LogManager::self_->d->lock_);
+
+    auto it = LogManager::self_->d->loggers_.find(name);
+    if (it != LogManager::self_->d->loggers_.end())
+        return it->second;
+
+    auto pair = LogManager::self_->d->loggers_.insert(std::make_pair(name, Logger::cout(name)));
+    return pair.first->second;
+}
+
+
+void vl::set_logger(const Logger& logger)
+{
+    if (!LogManager::self_)
+    {
+        throw std::runtime_error("Trying to set logger without valid LogManager");
+    }
 
+    std::lock_guard<std::mutex> lock(LogManager::self_->d->lock_);
 
-namespace vl
+    auto it = LogManager::self_->d->loggers_.find(logger.name());
+    if (it != LogManager::self_->d->loggers_.end())
+    {
+        it->second = logger;
+    }
+    else
+    {
+        LogManager::self_->d->loggers_.insert(std::make_pair(logger.name(), logger));
+    }
+}
+
+
+namespace
 {
-    typedef std::shared_ptr<std::ostream> ostream_sptr;
+    // formatted date and time of the current second, per thread
+    struct TimestampCache
+    {
+        bool valid;
+        time_t second;
+        char text[TIMESTAMP_SIZE];
+    };
 
+    VL_THREAD_LOCAL TimestampCache timestamp_cache;
 
-    namespace d_
+    long long now_millis()
     {
-        struct Work
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // localtime and strftime run once a second per thread
+    const TimestampCache& time_at(long long millis, int& ms)
+    {
+        TimestampCache& cache = timestamp_cache;
+
+        time_t second = static_cast<time_t>(millis / 1000);
+        ms = static_cast<int>(millis % 1000);
+
+        if (!cache.valid || cache.second != second)
         {
-            Work(std::string&& m, bool cout, bool cerr, const std::vector<ostream_sptr>& ss)
-                : use_cout(cout)
-                , use_cerr(cerr)
-                , streams(ss)
-                , msg(std::move(m))
-            { }
+            struct tm timeinfo;
+#ifdef _MSC_VER
+            localtime_s(&timeinfo, &second);
+#else
+            localtime_r(&second, &timeinfo);
+#endif
+            char buf[TIMESTAMP_SIZE + 1];
+            strftime(buf, sizeof(buf), TIMESTAMP_FORMAT, &timeinfo);
 
-            bool use_cout;
-            bool use_cerr;
-            std::vector<ostream_sptr> streams;
-            std::string msg;
-        };
+            memcpy(cache.text, buf, TIMESTAMP_SIZE);
+            cache.second = second;
+            cache.valid = true;
+        }
+
+        return cache;
     }
 
 
-    // mutex is only needed for immediate output to synchronize access to streams
-    // when logging is done from worker thread, it is done only in one thread and
-    // don't need logging
-    template <typename T>
-    struct LoggerImplMutex;
+    // "0x<id>" of the current thread, formatted on first use in each thread
+    struct ThreadIdCache
+    {
+        size_t size;
+        char text[40];
+    };
 
-    template <>
-    struct LoggerImplMutex<vl::delegate> {};
+    VL_THREAD_LOCAL ThreadIdCache thread_id_cache;
 
-    template <>
-    struct LoggerImplMutex<vl::immediate>
+    const ThreadIdCache& current_thread_id()
     {
-        LoggerImplMutex()
-            : mutex(new std::mutex)
-        { }
+        ThreadIdCache& cache = thread_id_cache;
 
-        std::shared_ptr<std::mutex> mutex;
-    };
+        if (cache.size == 0)
+        {
+            std::ostringstream oss;
+            oss << "0x" << std::hex << std::this_thread::get_id();
+            std::string text = oss.str();
 
+            cache.size = std::min(text.size(), sizeof(cache.text));
+            memcpy(cache.text, text.data(), cache.size);
+        }
 
-    template <typename T>
-    struct LoggerT<T>::Impl : LoggerImplMutex<T>
-    {
-        Impl(const std::string& name) :
-            name         (name),
-            streams      (),
-            cout_level   (nologging),
-            cerr_level   (nologging),
-            streams_level(nologging),
-            options      (usual)
-        { }
+        return cache;
+    }
 
-        std::string                    name;
-        std::vector<ostream_sptr>      streams;
-        LogLevel                       cout_level;
-        LogLevel                       cerr_level;
-        LogLevel                       streams_level;
-        unsigned int                   options;  // LogOpts flags
+
+    // time and thread of a message logged earlier, formatted on another thread
+    struct Stamp
+    {
+        long long millis;
+        const char* thread_id;
+        size_t thread_id_size;
     };
 
 
-    struct LogManager::Impl
+    struct LevelName
     {
-        typedef std::queue<d_::Work, std::list<d_::Work>> queue_type;
-
-        std::mutex lock_;
-        std::map<std::string, vl::Logger> loggers_;
-        std::atomic<bool> is_running_;
-        std::thread writer_thread_;
-        queue_type msg_queue_;
-        vl::Event new_msgs_event_;
+        const char* text;
+        size_t size;
     };
-}
 
+#define LEVEL_NAME(name) { name, sizeof(name) - 1 }
 
-vl::LogManager::LogManager()
-    : d(new Impl)
-{
-    if (self_ != nullptr)
-        throw std::runtime_error("LogManager already created");
+    // indexed by vl::LogLevel
+    const LevelName level_names[] =
+    {
+        LEVEL_NAME(LL_DEBUG),
+        LEVEL_NAME(LL_INFO),
+        LEVEL_NAME(LL_WARNING),
+        LEVEL_NAME(LL_ERROR),
+        LEVEL_NAME(LL_CRITICAL)
+    };
 
-    self_ = this;
-    d->is_running_.store(true);
-    d->writer_thread_ = std::thread(&vl::LogManager::writer_loop, this);
-}
+#undef LEVEL_NAME
 
+    const size_t max_level_name_size = sizeof(LL_CRITICAL) - 1;
 
-vl::LogManager::~LogManager()
-{
-    self_ = nullptr;  // prevents queueing new messages
 
-    d->is_running_.store(false);  // ensures that loop is not entered again
-    d->new_msgs_event_.signal();  // unblocks the loop and signals to process any left messages
+    // slices of TIMESTAMP_FORMAT text by field
+    struct TimeField
+    {
+        char field;
+        size_t offset;
+        size_t size;
+    };
 
-    if (d->writer_thread_.joinable())
-        d->writer_thread_.join();
+    const TimeField time_fields[] =
+    {
+        { 'Y', 0, 4 },
+        { 'm', 5, 2 },
+        { 'd', 8, 2 },
+        { 'H', 11, 2 },
+        { 'M', 14, 2 },
+        { 'S', 17, 2 }
+    };
 
-    delete d;
-}
+    const char timestamp_layout[] = "0000-00-00 00:00:00";
 
 
-void vl::d_::queue_work(d_::Work&& work)
-{
-    if (!LogManager::self_)
+    void add_op(vl::d_::Pattern& result, vl::d_::PatternOpType type, size_t offset, size_t size)
     {
-        throw std::runtime_error("Trying to log messages without valid LogManager");
+        vl::d_::PatternOp op = { type, offset, size };
+        result.ops.push_back(op);
     }
 
-    std::lock_guard<std::mutex> lock(LogManager::self_->d->lock_);
-    LogManager::self_->d->msg_queue_.push(std::move(work));
-    LogManager::self_->d->new_msgs_event_.signal();
-}
-
-
-void vl::LogManager::writer_loop()
-{
-    Impl::queue_type tmp_queue_;
+    // ops are not merged across the message position
+    bool can_extend(const vl::d_::Pattern& result, size_t index)
+    {
+        return result.message_pos == vl::d_::npos || index >= result.message_pos;
+    }
 
-    for (;;)
+    void add_text(vl::d_::Pattern& result, char ch)
     {
-        if (d->is_running_.load())
-            d->new_msgs_event_.wait_for(std::chrono::seconds(1));
+        std::vector<vl::d_::PatternOp>& ops = result.ops;
 
-        {
-            std::lock_guard<std::mutex> lock(d->lock_);
+        if (!ops.empty() && ops.back().type == vl::d_::PO_Text && can_extend(result, ops.size() - 1))
+            ++ops.back().size;
+        else
+            add_op(result, vl::d_::PO_Text, result.text.size(), 1);
 
-            if (!d->is_running_.load() && d->msg_queue_.empty())
-                break;
+        result.text.push_back(ch);
+    }
 
-            tmp_queue_.swap(d->msg_queue_);
-            d->new_msgs_event_.reset();
-        }
+    // time fields separated by the separator they have in TIMESTAMP_FORMAT are
+    // merged into one slice, so the default date and time is a single copy
+    void add_time(vl::d_::Pattern& result, const TimeField& field)
+    {
+        std::vector<vl::d_::PatternOp>& ops = result.ops;
+        size_t count = ops.size();
 
-        while (!tmp_queue_.empty())
+        if (count >= 2 && ops[count - 1].type == vl::d_::PO_Text && ops[count - 1].size == 1
+            && ops[count - 2].type == vl::d_::PO_Time && can_extend(result, count - 2))
         {
-            d_::Work& work = tmp_queue_.front();
+            vl::d_::PatternOp& prev = ops[count - 2];
+            size_t separator = prev.offset + prev.size;
 
-            if (work.use_cout)
-            {
-                std::cout << work.msg;
-                std::cout.flush();
-            }
-            if (work.use_cerr)
-            {
-                std::cerr << work.msg;
-                std::cerr.flush();
-            }
-            for (ostream_sptr& stream : work.streams)
+            if (separator + 1 == field.offset
+                && timestamp_layout[separator] == result.text[ops[count - 1].offset])
             {
-                *stream << work.msg;
-                stream->flush();
+                result.text.resize(ops[count - 1].offset);
+                ops.pop_back();
+                ops.back().size += 1 + field.size;
+                return;
             }
-
-            tmp_queue_.pop();
         }
+
+        add_op(result, vl::d_::PO_Time, field.offset, field.size);
     }
 }
 
 
-vl::Logger vl::get_logger(const std::string& name)
+bool vl::d_::compile_pattern(const std::string& pattern, size_t name_size, Pattern& result)
 {
-    if (!LogManager::self_)
+    Pattern compiled;
+    compiled.message_pos = npos;
+
+    for (size_t i = 0; i < pattern.size(); ++i)
     {
-        throw std::runtime_error("Trying to get logger without valid LogManager");
+        if (pattern[i] != '%')
+        {
+            add_text(compiled, pattern[i]);
+            continue;
+        }
+
+        if (++i == pattern.size())
+            return false;
+
+        char field = pattern[i];
+        const TimeField* time = std::find_if(std::begin(time_fields), std::end(time_fields),
+                                             [field](const TimeField& f) { return f.field == field; });
+
+        if (time != std::end(time_fields))
+            add_time(compiled, *time);
+        else if (field == '%')
+            add_text(compiled, '%');
+        else if (field == 'f')
+            add_op(compiled, PO_Millis, 0, 3);
+        else if (field == 'l')
+            add_op(compiled, PO_Level, 0, max_level_name_size);
+        else if (field == 'n')
+            add_op(compiled, PO_Name, 0, name_size);
+        else if (field == 't')
+            add_op(compiled, PO_ThreadId, 0, sizeof(ThreadIdCache().text));
+        else if (field == 'v' && compiled.message_pos == npos)
+            compiled.message_pos = compiled.ops.size();
+        else
+            return false;
     }
 
-    std::lock_guard<std::mutex> lock(LogManager::self_->d->lock_);
+    // message goes last unless placed by %v
+    if (compiled.message_pos == npos)
+        compiled.message_pos = compiled.ops.size();
 
-    auto it = LogManager::self_->d->loggers_.find(name);
-    if (it != LogManager::self_->d->loggers_.end())
-        return it->second;
+    compiled.epilog_max_size = 0;
+    for (size_t i = compiled.message_pos; i < compiled.ops.size(); ++i)
+        compiled.epilog_max_size += compiled.ops[i].size;
 
-    auto pair = LogManager::self_->d->loggers_.insert(std::make_pair(name, Logger::cout(name)));
-    return pair.first->second;
+    result = std::move(compiled);
+    return true;
 }
 
 
-void vl::set_logger(const Logger& logger)
+std::string vl::d_::default_pattern(unsigned int options)
 {
-    if (!LogManager::self_)
-    {
-        throw std::runtime_error("Trying to set logger without valid LogManager");
-    }
+    std::string pattern;
+
+    if (!(options & notimestamp))
+        pattern += PATTERN_TIMESTAMP;
+    if (!(options & nologgername))
+        pattern += PATTERN_NAME;
+    if (!(options & nothreadid))
+        pattern += PATTERN_THREAD_ID;
+    if (!(options & nologlevel))
+        pattern += PATTERN_LEVEL;
+
+    return pattern + "%v";
+}
 
-    std::lock_guard<std::mutex> lock(LogManager::self_->d->lock_);
 
-    auto it = LogManager::self_->d->loggers_.find(logger.name());
-    if (it != LogManager::self_->d->loggers_.end())
-    {
-        it->second = logger;
-    }
-    else
+namespace
+{
+    // executes ops [first, last) of a compiled pattern for a message logged
+    // now on the current thread or, with [stamp], at the stamped time and thread
+    void run_pattern(vl::OutputBuffer& out, const vl::d_::Pattern& pattern, size_t first, size_t last,
+                     vl::LogLevel level, const std::string& name, const Stamp* stamp)
     {
-        LogManager::self_->d->loggers_.insert(std::make_pair(logger.name(), logger));
+        const TimestampCache* time = nullptr;
+        int ms = 0;
+
+        for (size_t i = first; i < last; ++i)
+        {
+            const vl::d_::PatternOp& op = pattern.ops[i];
+
+            switch (op.type)
+            {
+            case vl::d_::PO_Text:
+                out.append(pattern.text.data() + op.offset, op.size);
+                break;
+
+            case vl::d_::PO_Time:
+            case vl::d_::PO_Millis:
+                if (time == nullptr)
+                    time = &time_at(stamp ? stamp->millis : now_millis(), ms);
+
+                if (op.type == vl::d_::PO_Time)
+                {
+                    out.append(time->text + op.offset, op.size);
+                }
+                else
+                {
+                    out.push_back(static_cast<char>('0' + ms / 100));
+                    out.push_back(static_cast<char>('0' + ms / 10 % 10));
+                    out.push_back(static_cast<char>('0' + ms % 10));
+                }
+                break;
+
+            case vl::d_::PO_Level:
+                assert(level >= vl::debug && level <= vl::critical);
+                out.append(level_names[level].text, level_names[level].size);
+                break;
+
+            case vl::d_::PO_Name:
+                out.append(name.data(), name.size());
+                break;
+
+            case vl::d_::PO_ThreadId:
+                if (stamp)
+                {
+                    out.append(stamp->thread_id, stamp->thread_id_size);
+                }
+                else
+                {
+                    const ThreadIdCache& id = current_thread_id();
+                    out.append(id.text, id.size);
+                }
+                break;
+            }
+        }
     }
 }
 
 
-std::string createTimestamp()
+void vl::d_::render_captured(Work& work, std::string& scratch)
 {
-    char buf[80];
+    // time and thread id precede the arguments, see LoggerT::start_deferred
+    const char* captured = work.msg.data();
+
+    Stamp stamp;
+    memcpy(&stamp.millis, captured, sizeof(stamp.millis));
+    captured += sizeof(stamp.millis);
+    memcpy(&stamp.thread_id_size, captured, sizeof(stamp.thread_id_size));
+    captured += sizeof(stamp.thread_id_size);
+    stamp.thread_id = captured;
+    captured += stamp.thread_id_size;
 
-    auto now = std::chrono::system_clock::now();
-    time_t datetime = std::chrono::system_clock::to_time_t(now);
-    struct tm timeinfo = *localtime(&datetime);
-    strftime(buf, sizeof(buf), TIMESTAMP_FORMAT, &timeinfo);
+    const Layout& layout = *work.layout;
+    const Pattern& program = layout.program;
+    scratch.clear();
 
-    auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() % 1000;
-    std::stringstream ss;
-    ss << "[" << std::setfill('0') << std::setw(3) << millis << "]";
-    strcat(buf, ss.str().c_str());
+    {
+        StringBuffer out(scratch);
+        run_pattern(out, program, 0, program.message_pos, work.level, layout.name, &stamp);
+        work.format(out, captured);
+        run_pattern(out, program, program.message_pos, program.ops.size(), work.level, layout.name, &stamp);
+        if (layout.endl)
+            out.push_back('\n');
+        out.commit();
+    }
 
-    return buf;
+    work.msg.swap(scratch);
+    work.format = nullptr;
+    work.layout.reset();
 }
 
 
@@ -279,26 +1996,6 @@ vl::LogLevel vl::LogLevel_from_str(const std::string& level)
         return nologging;
 }
 
-const char* getLogLevel(vl::LogLevel l)
-{
-    switch (l)
-    {
-    case vl::debug:
-        return LL_DEBUG;
-    case vl::info:
-        return LL_INFO;
-    case vl::warning:
-        return LL_WARNING;
-    case vl::error:
-        return LL_ERROR;
-    case vl::critical:
-        return LL_CRITICAL;
-    default:
-        assert(0);
-        return "Unknown";
-    }
-}
-
 
 namespace
 {
@@ -322,6 +2019,8 @@ namespace
 template <typename T>
 vl::LoggerT<T>::LoggerT(const std::string& name)
     : pimpl_(new Impl(name))
+    , min_level_(nologging)
+    , deferred_(false)
 {
 }
 
@@ -336,6 +2035,8 @@ vl::LoggerT<T>::~LoggerT()
 template <typename T>
 vl::LoggerT<T>::LoggerT(const LoggerT<T>& other)
     : pimpl_(new Impl(*other.pimpl_))
+    , min_level_(other.min_level_)
+    , deferred_(other.deferred_)
 {
 }
 
@@ -352,6 +2053,8 @@ template <typename T>
 void vl::LoggerT<T>::swap(LoggerT<T>& other)
 {
     std::swap(pimpl_, other.pimpl_);
+    std::swap(min_level_, other.min_level_);
+    std::swap(deferred_, other.deferred_);
 }
 
 
@@ -366,6 +2069,7 @@ template <typename T>
 void vl::LoggerT<T>::set_cout(LogLevel reporting_level)
 {
     pimpl_->cout_level = reporting_level;
+    update_min_level();
 }
 
 
@@ -373,6 +2077,7 @@ template <typename T>
 void vl::LoggerT<T>::set_cerr(LogLevel reporting_level)
 {
     pimpl_->cerr_level = reporting_level;
+    update_min_level();
 }
 
 
@@ -380,8 +2085,13 @@ template <typename T>
 bool vl::LoggerT<T>::add_stream(std::ostream* stream, LogLevel reporting_level)
 {
     assert(stream != nullptr && reporting_level != nologging);
-    pimpl_->streams.push_back(std::shared_ptr<std::ostream>(stream));
+
+    // queued messages may still refer to the current set
+    std::shared_ptr<d_::Streams> streams(new d_::Streams(*pimpl_->sinks.streams));
+    streams->push_back(std::shared_ptr<std::ostream>(stream));
+    pimpl_->sinks.reset(streams);
     pimpl_->streams_level = reporting_level;
+    update_min_level();
     return true;
 }
 
@@ -417,7 +2127,8 @@ bool vl::LoggerT<T>::add_stream(const std::string& filename, LogLevel reporting_
 template <typename T>
 void vl::LoggerT<T>::clear_streams()
 {
-    pimpl_->streams.clear();
+    pimpl_->sinks.reset(std::make_shared<d_::Streams>());
+    update_min_level();
 }
 
 
@@ -425,6 +2136,8 @@ template <typename T>
 void vl::LoggerT<T>::set(LogOpts opt)
 {
     ::set(pimpl_->options, opt);
+    pimpl_->compile();
+    update_deferred();
 }
 
 
@@ -432,6 +2145,8 @@ template <typename T>
 void vl::LoggerT<T>::unset(LogOpts opt)
 {
     ::unset(pimpl_->options, opt);
+    pimpl_->compile();
+    update_deferred();
 }
 
 
@@ -439,6 +2154,42 @@ template <typename T>
 void vl::LoggerT<T>::reset()
 {
     pimpl_->options = usual;
+    pimpl_->compile();
+    update_deferred();
+}
+
+
+template <typename T>
+void vl::LoggerT<T>::update_deferred()
+{
+    // immediate loggers write on the calling thread anyway
+    deferred_ = std::is_same<T, delegate>::value && is_set(pimpl_->options, vl::deferred);
+}
+
+
+template <typename T>
+void vl::LoggerT<T>::update_min_level()
+{
+    LogLevel level = std::min(pimpl_->cout_level, pimpl_->cerr_level);
+
+    if (!pimpl_->sinks.streams->empty())
+        level = std::min(level, pimpl_->streams_level);
+
+    min_level_ = level;
+}
+
+
+template <typename T>
+bool vl::LoggerT<T>::set_pattern(const std::string& pattern)
+{
+    d_::Pattern program;
+
+    if (!pattern.empty() && !d_::compile_pattern(pattern, pimpl_->name.size(), program))
+        return false;
+
+    pimpl_->pattern = pattern;
+    pimpl_->compile();
+    return true;
 }
 
 
@@ -448,46 +2199,153 @@ vl::d_::LogWorker<T> vl::LoggerT<T>::log(LogLevel level)
     assert(level != nologging);
     return d_::LogWorker<T>(this, level);
 }
-template <typename T> vl::d_::LogWorker<T> vl::LoggerT<T>::debug()   { return log(vl::debug); }
-template <typename T> vl::d_::LogWorker<T> vl::LoggerT<T>::info()    { return log(vl::info); }
-template <typename T> vl::d_::LogWorker<T> vl::LoggerT<T>::warning() { return log(vl::warning); }
-template <typename T> vl::d_::LogWorker<T> vl::LoggerT<T>::error()   { return log(vl::error); }
-template <typename T> vl::d_::LogWorker<T> vl::LoggerT<T>::critical(){ return log(vl::critical); }
 
 
 template <typename T>
-void vl::LoggerT<T>::add_prelude(std::string& out, LogLevel level)
+void vl::LoggerT<T>::add_prelude(OutputBuffer& out, LogLevel level)
 {
-    if (!is_set(pimpl_->options, notimestamp))
-        safe_sprintf(out, "{0} ", createTimestamp());
-    if (!is_set(pimpl_->options, nologgername))
-        safe_sprintf(out, "[{0}] ", pimpl_->name);
-    if (!is_set(pimpl_->options, nothreadid))
-        safe_sprintf(out, "0x{0:x} ", std::this_thread::get_id());
-    if (!is_set(pimpl_->options, nologlevel))
-        safe_sprintf(out, "<{0}> ", getLogLevel(level));
+    const d_::Pattern& program = pimpl_->layout->program;
+    run_pattern(out, program, 0, program.message_pos, level, pimpl_->name, nullptr);
 }
 
 
 template <typename T>
-void vl::LoggerT<T>::add_epilog(std::string& out, LogLevel /*level*/)
+void vl::LoggerT<T>::add_epilog(std::string& out, LogLevel level)
 {
-    if (!is_set(pimpl_->options, noendl))
+    const d_::Layout& layout = *pimpl_->layout;
+    const d_::Pattern& program = layout.program;
+
+    if (program.message_pos != program.ops.size())
+    {
+        d_::StringBuffer buffer(out);
+        run_pattern(buffer, program, program.message_pos, program.ops.size(), level, pimpl_->name, nullptr);
+        buffer.commit();
+    }
+
+    if (layout.endl)
         out.push_back('\n');
 }
 
 
+template <typename T>
+void vl::LoggerT<T>::write_message(LogLevel level, const char* body, size_t size)
+{
+    std::string msg;
+    start_message(msg, level, size);
+    msg.append(body, size);
+    finish_message(msg, level);
+}
+
+
+template <typename T>
+void vl::LoggerT<T>::start_message(std::string& msg, LogLevel level, size_t body_size)
+{
+    MemoryBuffer<128> prelude;
+    add_prelude(prelude, level);
+
+    // epilog is at most a newline after the pattern's part following the message,
+    // a recycled buffer is usually big enough already
+    size_t size = msg.size() + prelude.size() + body_size + pimpl_->layout->program.epilog_max_size + 1;
+    if (msg.capacity() < size)
+        msg.reserve(size);
+    msg.append(prelude.data(), prelude.size());
+}
+
+
+template <typename T>
+void vl::LoggerT<T>::finish_message(std::string& msg, LogLevel level)
+{
+    add_epilog(msg, level);
+    write_to_streams(level, std::move(msg));
+}
+
+
+template <typename T>
+char* vl::LoggerT<T>::start_deferred(d_::Work*& work, size_t args_size)
+{
+    // read back by d_::render_captured
+    long long millis = now_millis();
+    const ThreadIdCache& id = current_thread_id();
+    size_t header_size = sizeof(millis) + sizeof(id.size) + id.size;
+
+    work = d_::acquire_work();
+    std::string& captured = work->msg;
+    captured.resize(header_size + args_size);
+    char* p = &captured[0];
+    memcpy(p, &millis, sizeof(millis));
+    p += sizeof(millis);
+    memcpy(p, &id.size, sizeof(id.size));
+    p += sizeof(id.size);
+    memcpy(p, id.text, id.size);
+
+    return p + id.size;
+}
+
+
+template <typename T>
+void vl::LoggerT<T>::queue_deferred(d_::Work* work, LogLevel level, d_::CapturedFormat format)
+{
+    assert((std::is_same<T, delegate>::value) && "Only vl::Logger defers formatting");
+
+    work->layout = pimpl_->layout;
+    work->format = format;
+    queue_message(work, level);
+}
+
+
+template <typename T>
+unsigned int vl::LoggerT<T>::route(LogLevel level)
+{
+    unsigned int result = 0;
+
+    if (level >= pimpl_->cout_level)
+        result |= d_::ROUTE_COUT;
+    if (level >= pimpl_->cerr_level)
+        result |= d_::ROUTE_CERR;
+    if (level >= pimpl_->streams_level && !pimpl_->sinks.streams->empty())
+        result |= d_::sink_slot(pimpl_->sinks) << d_::ROUTE_SLOT_SHIFT;
+
+    return result;
+}
+
+
+template <typename T>
+void vl::LoggerT<T>::queue_message(d_::Work* work, LogLevel level)
+{
+    // held until the message is queued, so that the writer cannot release the
+    // slot of the streams and hand it to other ones while the message is on its way
+    std::shared_ptr<const d_::Streams> streams;
+    if (level >= pimpl_->streams_level)
+        streams = pimpl_->sinks.streams;
+
+    work->level = level;
+    work->route = route(level);
+    d_::queue_work(work);
+}
+
+
 namespace vl
 {
+    // formatted straight into a recycled message, so that it usually allocates nothing
+    template <>
+    void LoggerT<vl::delegate>::write_message(LogLevel level, const char* body, size_t size)
+    {
+        std::unique_ptr<d_::Work> work(d_::acquire_work());
+        start_message(work->msg, level, size);
+        work->msg.append(body, size);
+        add_epilog(work->msg, level);
+
+        queue_message(work.release(), level);
+    }
+
+
     template <>
     void LoggerT<vl::delegate>::write_to_streams(LogLevel level, std::string&& msg)
     {
-        d_::queue_work(d_::Work(std::move(msg),
-                                level >= pimpl_->cout_level,
-                                level >= pimpl_->cerr_level,
-                                (level >= pimpl_->streams_level && !pimpl_->streams.empty()
-                                    ? pimpl_->streams
-                                    : std::vector<ostream_sptr>())));
+        std::unique_ptr<d_::Work> work(d_::acquire_work());
+        work->msg.swap(msg);
+
+        queue_message(work.release(), level);
     }
 
 
@@ -504,11 +2362,11 @@ namespace vl
             fprintf(stderr, "%s", msg.c_str());
             fflush(stderr);
         }
-        if (level >= pimpl_->streams_level && !pimpl_->streams.empty())
+        if (level >= pimpl_->streams_level && !pimpl_->sinks.streams->empty())
         {
             std::lock_guard<std::mutex> l(*pimpl_->mutex);
 
-            for (ostream_sptr& stream : pimpl_->streams)
+            for (const ostream_sptr& stream : *pimpl_->sinks.streams)
             {
                 *stream << msg;
                 stream->flush();
@@ -524,8 +2382,10 @@ void vl::LoggerT<T>::log_error(const std::string& fmt, const char* error_msg)
     // make sure we log it at least to cerr
     LogLevel old_cerr = pimpl_->cerr_level;
     pimpl_->cerr_level = vl::warning;
+    update_min_level();
     log(vl::error, "Error while formatting '{0}': \"{1}\"", fmt, error_msg);
     pimpl_->cerr_level = old_cerr;
+    update_min_level();
 }
 
 
@@ -536,18 +2396,26 @@ vl::d_::LogWorker<T>::LogWorker(LoggerT<T>* logger, LogLevel level)
     , msg_stream_()
     , options_(logger_->pimpl_->options)
     , quote_(false)
+    , enabled_(logger_->should_log(level))
 {
-    std::string out;
-    logger_->add_prelude(out, level);
-    msg_stream_ << out;
+    if (!enabled_)
+        return;
+
+    msg_stream_.reset(new std::ostringstream);
+    MemoryBuffer<128> prelude;
+    logger_->add_prelude(prelude, level);
+    msg_stream_->write(prelude.data(), prelude.size());
 }
 
 
 template <typename T>
 vl::d_::LogWorker<T>::~LogWorker()
 {
+    if (!enabled_)
+        return;
+
     assert(logger_);
-    std::string msg(msg_stream_.str());
+    std::string msg(msg_stream_->str());
     logger_->add_epilog(msg, msg_level_);
     logger_->write_to_streams(msg_level_, std::move(msg));
 }
@@ -557,14 +2425,13 @@ template <typename T>
 vl::d_::LogWorker<T>::LogWorker(LogWorker&& other)
     : logger_(other.logger_)
     , msg_level_(other.msg_level_)
-    , msg_stream_()
+    , msg_stream_(std::move(other.msg_stream_))
     , options_(other.options_)
     , quote_(other.quote_)
+    , enabled_(other.enabled_)
 {
-    // FIXME: use msg_stream_ move constructor to move it
-    // as soon as gcc supports it
-    msg_stream_ << other.msg_stream_.rdbuf();
     other.logger_ = nullptr;
+    other.enabled_ = false;
 }
 
 
@@ -572,7 +2439,7 @@ template <typename T>
 void vl::d_::LogWorker<T>::optionally_add_space()
 {
     if (!(options_ & nospace))
-        msg_stream_ << " ";
+        *msg_stream_ << " ";
 }
 
 template class vl::d_::LogWorker<vl::delegate>;
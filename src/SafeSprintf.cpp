@@ -8,210 +8,428 @@
 #include "VariadicLogger/SafeSprintf.h"
 
 #include <stdexcept>
-#include <assert.h>
-#include <ctype.h>
 #include <iomanip>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <thread>
+#include <functional>
+
+#include <vector>
+#include <cmath>
+
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <locale.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define VL_SSE2_SUPPORTED
+    #include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+    #include <immintrin.h>
+#endif
 
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
 
-vl::d_::Split vl::d_::split_format(const std::string& fmt)
+
+int vl::d_::format_failure(const char* what)
 {
-    Split result;
-    size_t start = 0;
-    size_t end = 0;
-    size_t pos = 0;
+    assert(false && "Error in format string");
+    throw vl::format_error(what);
+}
 
-    for (;;)
+
+namespace
+{
+#if defined(VL_SSE2_SUPPORTED) || defined(__AVX2__)
+    // index of the lowest set bit, [mask] is not 0
+    inline unsigned int lowest_bit(unsigned int mask)
     {
-        start = fmt.find('{', pos);
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return index;
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+#endif
 
-        if (start == fmt.npos)
-        {
-            if (pos != fmt.npos)
-                result.push_back(Substring(SubstrText, fmt.substr(pos)));
+    // position of the first brace in [s] at or after [pos], npos if there is none;
+    // compares a whole vector register of characters per step where available
+    size_t find_brace(const char* s, size_t n, size_t pos)
+    {
+#ifdef __AVX2__
+        const __m256i open32 = _mm256_set1_epi8('{');
+        const __m256i close32 = _mm256_set1_epi8('}');
 
-            pos = fmt.npos;
+        for (; pos + 32 <= n; pos += 32)
+        {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + pos));
+            __m256i braces = _mm256_or_si256(_mm256_cmpeq_epi8(block, open32), _mm256_cmpeq_epi8(block, close32));
+            unsigned int mask = static_cast<unsigned int>(_mm256_movemask_epi8(braces));
 
-            break;
+            if (mask != 0)
+                return pos + lowest_bit(mask);
         }
-        else
-        {
-            if (start + 1 < fmt.size() && fmt[start + 1] == '{')
-            {
-                result.push_back(Substring(SubstrText, fmt.substr(pos, start - pos + 2)));
-                pos = start + 2;
-                continue;
-            }
+#endif
 
-            if (start != pos)
-                result.push_back(Substring(SubstrText, fmt.substr(pos, start - pos)));
+#ifdef VL_SSE2_SUPPORTED
+        const __m128i open16 = _mm_set1_epi8('{');
+        const __m128i close16 = _mm_set1_epi8('}');
 
-            pos = start;
+        for (; pos + 16 <= n; pos += 16)
+        {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + pos));
+            __m128i braces = _mm_or_si128(_mm_cmpeq_epi8(block, open16), _mm_cmpeq_epi8(block, close16));
+            unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(braces));
+
+            if (mask != 0)
+                return pos + lowest_bit(mask);
         }
+#endif
 
-        // loop until we find a closing curly brace
-        for (;;)
+        for (; pos < n; ++pos)
         {
-            // ok if we go out of bounds, because it will return npos anyway
-            end = fmt.find('}', pos + 1);
+            if (s[pos] == '{' || s[pos] == '}')
+                return pos;
+        }
 
-            if (end == fmt.npos)
-            {
-                assert(false && "Error in format string: no closing curly brace.");
-                throw vl::format_error("Error in format string: no closing curly brace.");
-            }
-            else
-            {
-                if (end + 1 < fmt.size() && fmt[end + 1] == '}')
-                {
-                    pos = end + 2;
-                    continue;
-                }
+        return vl::d_::npos;
+    }
+}
 
-                result.push_back(Substring(SubstrAnchor, fmt.substr(start + 1, end - start - 1)));
-                pos = end + 1;
-                break;
-            }
-        }
+
+vl::d_::SplitPtr vl::d_::split_format(FormatView fmt)
+{
+    std::shared_ptr<Split> result = std::make_shared<Split>();
+    result->fmt.assign(fmt.data, fmt.size);
+
+    const char* s = result->fmt.data();
+    size_t n = result->fmt.size();
+    size_t pos = 0;
+
+    while (pos < n)
+    {
+        Chunk chunk = chunk_at_brace(s, n, pos, find_brace(s, n, pos));
+        result->chunks.push_back(chunk);
+        pos = chunk.next;
     }
 
     return result;
 }
 
 
-void vl::d_::join(std::string& out, const Split& split)
+void vl::d_::vformat(OutputBuffer& out, FormatView fmt, const Arg* args, size_t count)
 {
-    for (const Substring& chunk : split)
+    SplitPtr split = cached_split(fmt);
+    format_chunks(out, split->fmt.data(), split->chunks.data(), split->chunks.size(), args, count);
+}
+
+
+void vl::d_::format_chunks(OutputBuffer& out, const char* fmt, const Chunk* chunks, size_t size, const Arg* args, size_t count)
+{
+    for (const Chunk* chunk = chunks; chunk != chunks + size; ++chunk)
     {
-        if (chunk.type == SubstrText)
+        if (chunk->type == SubstrAnchor && static_cast<size_t>(chunk->index) < count)
         {
-            out.append(chunk.content);
+            const Arg& arg = args[chunk->index];
+            arg.format(out, chunk->spec, arg.value);
         }
-        else
+        else  // text or the whole anchor when the argument is missing
         {
-            out.push_back('{');
-            out.append(chunk.content);
-            out.push_back('}');
+            out.append(fmt + chunk->offset, chunk->length);
         }
     }
 }
 
 
-bool vl::d_::has_index(const std::string& substr, int index)
+namespace
 {
-    size_t pos = substr.find(':');
+    // format string looked up in the cache by the address and length of the
+    // caller's text, which is never read through it
+    struct CacheKey
+    {
+        const char* data;
+        size_t size;
+    };
 
-    if ((pos != substr.npos && pos < 1) || (pos == substr.npos && substr.size() < 1))
+    struct CacheKeyHash
     {
-        assert(false && "No position marker provided");
-        throw vl::format_error("No position marker provided");
-    }
+        size_t operator()(const CacheKey& key) const
+        {
+            // strings are aligned, so the low bits of their addresses are mostly zero
+            uint64_t h = (static_cast<uint64_t>(reinterpret_cast<uintptr_t>(key.data)) ^ key.size)
+                         * 0x9E3779B97F4A7C15ull;
+            return static_cast<size_t>(h ^ (h >> 32));
+        }
+    };
 
-    try
+    struct CacheKeyEqual
     {
-        return index == stoi(substr.substr(0, pos));
-    }
-    catch (const std::logic_error& ex)
+        bool operator()(const CacheKey& a, const CacheKey& b) const
+        {
+            return a.data == b.data && a.size == b.size;
+        }
+    };
+
+    /*
+     * Readers only count themselves in, a writer keeps new readers out and
+     * waits for those inside to leave. The cache is written on misses only,
+     * so waiting just yields.
+     */
+    class SharedLock
     {
-        assert(false && "Error in position marker");
-        throw vl::format_error(std::string("Error in position marker: ") + ex.what());
-    }
-}
+    public:
+        SharedLock() : readers_(0), writing_(false) { }
+
+        void lock_shared()
+        {
+            for (;;)
+            {
+                if (!writing_.load())
+                {
+                    readers_.fetch_add(1);
+                    if (!writing_.load())
+                        return;
+                    readers_.fetch_sub(1);
+                }
+                std::this_thread::yield();
+            }
+        }
 
+        void unlock_shared() { readers_.fetch_sub(1); }
 
-namespace
-{
+        void lock()
+        {
+            writers_.lock();
+            writing_.store(true);
+            while (readers_.load() != 0)
+                std::this_thread::yield();
+        }
 
+        void unlock()
+        {
+            writing_.store(false);
+            writers_.unlock();
+        }
 
-    enum Align
-    {
-        A_Left,   // default for text
-        A_Right,  // default for numers
-        A_Center,
-        A_SignAware    // e. g. +0000123
+    private:
+        SharedLock(const SharedLock&);
+        SharedLock& operator=(const SharedLock&);
+
+        std::atomic<int> readers_;
+        std::atomic<bool> writing_;
+        std::mutex writers_;
     };
 
-    enum Sign
+    struct SharedLockGuard
     {
-        S_Both,
-        S_Negative,   // Default
-        S_Space       // Space for positive, minus for negative
+        explicit SharedLockGuard(SharedLock& l) : lock(l) { lock.lock_shared(); }
+        ~SharedLockGuard() { lock.unlock_shared(); }
+
+        SharedLock& lock;
+
+    private:
+        SharedLockGuard(const SharedLockGuard&);
+        SharedLockGuard& operator=(const SharedLockGuard&);
     };
 
-    struct Format
-    {
-        char fill;
-        Align align;
-        Sign sign;
-        bool alternate_form;
-        int width;
-        bool use_thousand_sep;
-        int precision;
-        char type;
-
-        explicit Format(vl::d_::ValueType vtype)
-            : fill(' ')
-            , align(A_Left)
-            , sign(S_Negative)
-            , alternate_form(false)
-            , width(0)
-            , use_thousand_sep(false)
-            , precision(-1)
-            , type('s')
-        {
-            switch (vtype)
+    bool same_text(const vl::d_::Split& split, vl::d_::FormatView fmt)
+    {
+        return split.fmt.size() == fmt.size && memcmp(split.fmt.data(), fmt.data, fmt.size) == 0;
+    }
+
+    /*
+     * Bounded map from format string to its split, keyed by the address of the
+     * caller's text, so a hit neither hashes nor copies it. The text is still
+     * compared with the cached one, as a buffer may be reused for another
+     * string; such a hit is counted as a miss and replaces the entry. Split
+     * into shards that threads look up under a shared lock. Instead of keeping
+     * a list in use order, a hit marks its entry with the shard's clock, which
+     * only advances with misses, and a full shard evicts the entry with the
+     * oldest mark, so hot entries are not written to and eviction is LRU only
+     * approximately.
+     */
+    class FormatCache
+    {
+    public:
+        FormatCache()
+            : capacity_(0)
+        {
+            set_capacity(default_capacity);
+        }
+
+        vl::d_::SplitPtr get(vl::d_::FormatView fmt)
+        {
+            CacheKey key = { fmt.data, fmt.size };
+            Shard& shard = shards_[CacheKeyHash()(key) % shard_count];
+
             {
-            case vl::d_::VT_Integral:
-                type = 'd';
-                align = A_Right;
-                break;
-            case vl::d_::VT_Floating:
-                type = 'g';
-                align = A_Right;
-                break;
-            case vl::d_::VT_Other:
-                // already set
-                break;
-            default:
-                assert(false && "Bad value type");
-                throw vl::format_error("Bad value type");
+                SharedLockGuard lock(shard.lock);
+
+                auto it = shard.entries.find(key);
+                if (it != shard.entries.end() && same_text(*it->second.split, fmt))
+                {
+                    shard.hits.fetch_add(1, std::memory_order_relaxed);
+
+                    size_t now = shard.clock.load(std::memory_order_relaxed);
+                    if (it->second.used.load(std::memory_order_relaxed) != now)
+                        it->second.used.store(now, std::memory_order_relaxed);
+                    return it->second.split;
+                }
+
+                shard.misses.fetch_add(1, std::memory_order_relaxed);
             }
+
+            // parse outside of the lock, a concurrent miss on the same string just parses twice
+            vl::d_::SplitPtr split = vl::d_::split_format(fmt);
+
+            std::lock_guard<SharedLock> lock(shard.lock);
+
+            if (shard.capacity == 0)
+                return split;
+
+            auto it = shard.entries.find(key);
+            if (it == shard.entries.end())
+            {
+                if (shard.entries.size() >= shard.capacity)
+                    shard.evict_oldest();
+                it = shard.entries.insert(std::make_pair(key, Entry())).first;
+            }
+
+            size_t now = shard.clock.load(std::memory_order_relaxed) + 1;
+            shard.clock.store(now, std::memory_order_relaxed);
+            it->second.split = split;
+            it->second.used.store(now, std::memory_order_relaxed);
+            return split;
         }
 
-        static Align align_from_char(char ch)
+        vl::FormatCacheStats stats()
         {
-            switch (ch)
+            vl::FormatCacheStats result = { 0, 0, 0, 0 };
+
+            for (Shard& shard : shards_)
             {
-            case '>':
-                return A_Right;
-            case '<':
-                return A_Left;
-            case '=':
-                return A_SignAware;
-            case '^':
-                return A_Center;
-            default:
-                assert(false && "Bad align chracter");
-                throw vl::format_error(std::string("Bad align chracter: ") + ch);
-            };
-        }
-
-        static Sign sign_from_char(char ch)
-        {
-            switch (ch)
+                SharedLockGuard lock(shard.lock);
+                result.hits += shard.hits.load(std::memory_order_relaxed);
+                result.misses += shard.misses.load(std::memory_order_relaxed);
+                result.size += shard.entries.size();
+            }
+
+            result.capacity = capacity_;
+            return result;
+        }
+
+        // shards get an equal share, the first ones one more of what is left
+        void set_capacity(size_t capacity)
+        {
+            for (size_t i = 0; i < shard_count; ++i)
+            {
+                Shard& shard = shards_[i];
+                std::lock_guard<SharedLock> lock(shard.lock);
+
+                shard.capacity = capacity / shard_count + (i < capacity % shard_count ? 1 : 0);
+                while (shard.entries.size() > shard.capacity)
+                    shard.evict_oldest();
+            }
+
+            capacity_ = capacity;
+        }
+
+        void clear()
+        {
+            for (Shard& shard : shards_)
             {
-            case '+':
-                return S_Both;
-            case '-':
-                return S_Negative;
-            case ' ':
-                return S_Space;
-            default:
-                assert(false && "Bad sign chracter");
-                throw vl::format_error(std::string("Bad sign chracter: ") + ch);
-            };
+                std::lock_guard<SharedLock> lock(shard.lock);
+                shard.entries.clear();
+                shard.hits.store(0, std::memory_order_relaxed);
+                shard.misses.store(0, std::memory_order_relaxed);
+            }
         }
+
+    private:
+        static const size_t shard_count = 16;
+        static const size_t default_capacity = 1024;
+
+        struct Entry
+        {
+            Entry() : split(), used(0) { }
+            Entry(const Entry& other) : split(other.split), used(other.used.load()) { }
+
+            vl::d_::SplitPtr split;
+            std::atomic<size_t> used;  // shard's clock at the last hit, written under the shared lock
+        };
+
+        struct Shard
+        {
+            Shard() : capacity(0), clock(0), hits(0), misses(0) {}
+
+            // a shard holds capacity / 16 entries, few enough to scan
+            void evict_oldest()
+            {
+                auto oldest = entries.begin();
+                for (auto it = entries.begin(); it != entries.end(); ++it)
+                {
+                    if (it->second.used.load(std::memory_order_relaxed)
+                        < oldest->second.used.load(std::memory_order_relaxed))
+                        oldest = it;
+                }
+                entries.erase(oldest);
+            }
+
+            SharedLock lock;
+            std::unordered_map<CacheKey, Entry, CacheKeyHash, CacheKeyEqual> entries;
+            size_t capacity;
+            std::atomic<size_t> clock;  // advances with each entry stored
+            std::atomic<size_t> hits;
+            std::atomic<size_t> misses;
+        };
+
+        Shard shards_[shard_count];
+        std::atomic<size_t> capacity_;
     };
 
+    FormatCache& format_cache()
+    {
+        static FormatCache cache;
+        return cache;
+    }
+}
+
+
+vl::d_::SplitPtr vl::d_::cached_split(FormatView fmt)
+{
+    return format_cache().get(fmt);
+}
+
+
+vl::FormatCacheStats vl::format_cache_stats()
+{
+    return format_cache().stats();
+}
+
+
+void vl::set_format_cache_capacity(size_t capacity)
+{
+    format_cache().set_capacity(capacity);
+}
+
+
+void vl::clear_format_cache()
+{
+    format_cache().clear();
+}
+
+
+namespace
+{
     template <int N>
     bool char_in_set(char ch, const char (&set)[N])
     {
@@ -221,170 +439,597 @@ namespace
         return false;
     }
 
-    Format parse_format(const std::string& format, vl::d_::ValueType type)
-    {
-        /*
-         * format_spec ::=  [[fill]align][sign][#][0][width][,][.precision][type]
-         * fill        ::=  <a character other than '{' or '}'>
-         * align       ::=  "<" | ">" | "=" | "^"
-         * sign        ::=  "+" | "-" | " "
-         * width       ::=  integer
-         * precision   ::=  integer
-         * type        ::=  "b" | "d" | "e" | "E" | "f" | "F" | "g" | "G" | "o" | "s" | "x" | "X" | "%"
-         */
-
-        char aligns[] = "><=^";
-        char signs[] = "+- ";
-        char types[] = "sbdoxXeEfFgG%";
+    // checks the parts of the specifier that depend on the argument type
+    void check_spec(const vl::d_::FormatSpec& f, vl::d_::ValueType type)
+    {
         char int_types[] = "bdoxX";
         char float_types[] = "eEfFgG%";
         char other_types[] = "s";
-        int index = 0;
-        Format f(type);
 
-        if (index == static_cast<int>(format.size()))
-            return f;
+        if (type == vl::d_::VT_Integral && f.precision != -1)
+        {
+            assert(false && "Precision is not allowed for integral types");
+            throw vl::format_error("Precision is not allowed for integral types");
+        }
 
-        // [[fill]align]
+        if (f.type == '\0')
+            return;
 
-        if (index+1 < static_cast<int>(format.size()) && char_in_set(format[index+1], aligns))
+        if (type == vl::d_::VT_Other && !char_in_set(f.type, other_types))
         {
-            f.align = Format::align_from_char(format[index+1]);
-            f.fill = format[index];
-            index += 2;
+            assert(false && "Incorrect format for non-number type");
+            throw vl::format_error("Incorrect format for non-number type");
         }
-        else if (char_in_set(format[index], aligns))
+
+        if (type == vl::d_::VT_Integral && !char_in_set(f.type, int_types))
         {
-            f.align = Format::align_from_char(format[index]);
-            ++index;
+            assert(false && "Incorrect format for integral type");
+            throw vl::format_error("Incorrect format for integral type");
         }
 
-        if (index == static_cast<int>(format.size()))
-            return f;
+        if (type == vl::d_::VT_Floating && !char_in_set(f.type, float_types))
+        {
+            assert(false && "Incorrect format for floating type");
+            throw vl::format_error("Incorrect format for floating type");
+        }
+    }
+}
 
-        // [sign]
+namespace
+{
+    const char digit_pairs[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+    // digits are written backwards, ending right before [end]; returns the first digit
+
+    char* write_decimal(char* end, unsigned long long value)
+    {
+        while (value >= 100)
+        {
+            unsigned int pair = static_cast<unsigned int>(value % 100) * 2;
+            value /= 100;
+            *--end = digit_pairs[pair + 1];
+            *--end = digit_pairs[pair];
+        }
 
-        if (char_in_set(format[index], signs))
+        if (value < 10)
         {
-            f.sign = Format::sign_from_char(format[index]);
-            ++index;
+            *--end = static_cast<char>('0' + value);
+        }
+        else
+        {
+            unsigned int pair = static_cast<unsigned int>(value) * 2;
+            *--end = digit_pairs[pair + 1];
+            *--end = digit_pairs[pair];
         }
 
-        if (index == static_cast<int>(format.size()))
-            return f;
+        return end;
+    }
 
-        // [#]
+    char* write_grouped_decimal(char* end, unsigned long long value)
+    {
+        char digits[24];
+        char* digits_end = digits + sizeof(digits);
+        char* first = write_decimal(digits_end, value);
 
-        if (format[index] == '#')
+        for (int count = 0; digits_end != first; ++count)
         {
-            f.alternate_form = true;
-            ++index;
+            if (count != 0 && count % 3 == 0)
+                *--end = ',';
+            *--end = *--digits_end;
         }
 
-        if (index == static_cast<int>(format.size()))
-            return f;
+        return end;
+    }
 
-        // [0]
-        if (format[index] == '0')
+    // [shift] is log2 of the base
+    char* write_power_of_two(char* end, unsigned long long value, unsigned int shift, const char* digits)
+    {
+        unsigned long long mask = (1ull << shift) - 1;
+
+        do
         {
-            f.fill = '0';
-            f.align = A_SignAware;
-            ++index;
+            *--end = digits[value & mask];
+            value >>= shift;
         }
+        while (value != 0);
 
-        if (index == static_cast<int>(format.size()))
-            return f;
+        return end;
+    }
 
-        // [width]
-        if (isdigit(format[index]))
-        {
-            int count = 1;
-            while (isdigit(format[index + count]))
-                ++count;
-            f.width = std::stoi(format.substr(index, count));
-            index += count;
-        }
 
-        if (index == static_cast<int>(format.size()))
-            return f;
+    char number_sign(const vl::d_::FormatSpec& spec, bool negative)
+    {
+        if (negative)
+            return '-';
+        if (spec.sign == '+' || spec.sign == ' ')
+            return spec.sign;
+        return '\0';
+    }
+
+    // pads sign, prefix and digits to the requested width, numbers are right aligned by default
+    void write_number(vl::OutputBuffer& out, const vl::d_::FormatSpec& spec, char sign,
+                      const char* prefix, size_t prefix_size, const char* digits, size_t digits_size)
+    {
+        size_t size = (sign != '\0' ? 1 : 0) + prefix_size + digits_size;
+        size_t padding = static_cast<size_t>(spec.width) > size ? spec.width - size : 0;
+        char align = spec.align != '\0' ? spec.align : '>';
+
+        size_t before = 0;
+        if (align == '>')
+            before = padding;
+        else if (align == '^')
+            before = padding / 2;
+
+        out.append(before, spec.fill);
+
+        if (sign != '\0')
+            out.push_back(sign);
+        out.append(prefix, prefix_size);
+
+        if (align == '=')
+            out.append(padding, spec.fill);
+
+        out.append(digits, digits_size);
+
+        if (align == '<' || align == '^')
+            out.append(padding - before, spec.fill);
+    }
 
-        // [,]
-        if (format[index] == ',')
+
+    /*
+     * Shortest digits that round-trip, using Grisu2 (Florian Loitsch, "Printing
+     * Floating-Point Numbers Quickly and Accurately with Integers").
+     */
+
+    struct DiyFp
+    {
+        DiyFp(uint64_t fr, int ex) : f(fr), e(ex) {}
+
+        DiyFp operator-(const DiyFp& rhs) const
         {
-            f.use_thousand_sep = true;
-            ++index;
+            return DiyFp(f - rhs.f, e);
         }
 
-        if (index == static_cast<int>(format.size()))
-            return f;
+        // upper 64 bits of the product, rounded
+        DiyFp operator*(const DiyFp& rhs) const
+        {
+            const uint64_t m32 = 0xFFFFFFFFu;
+            uint64_t a = f >> 32, b = f & m32, c = rhs.f >> 32, d = rhs.f & m32;
+            uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+            uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32) + (1u << 31);
+            return DiyFp(ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), e + rhs.e + 64);
+        }
 
-        // [.precision]
-        if (format[index] == '.')
+        DiyFp normalized() const
         {
-            if (!isdigit(format[index+1]))
+            DiyFp res = *this;
+            while (!(res.f & (1ull << 63)))
             {
-                assert(false && "Precision not specified after '.'");
-                throw vl::format_error("Precision not specified after '.'");
+                res.f <<= 1;
+                res.e--;
             }
+            return res;
+        }
 
-            if (type == vl::d_::VT_Integral)
-            {
-                assert(false && "Precision is not allowed for integral types");
-                throw vl::format_error("Precision is not allowed for integral types");
-            }
+        uint64_t f;
+        int e;
+    };
 
-            ++index;  // skip the dot
-            int count = 1;  // we already checked that first character after the dot is digit
+    // normalized 10^(-348 + 8 * i)
+    DiyFp cached_power(int index)
+    {
+        static const uint64_t significands[] = {
+        0xfa8fd5a0081c0288ull, 0xbaaee17fa23ebf76ull, 0x8b16fb203055ac76ull, 0xcf42894a5dce35eaull,
+        0x9a6bb0aa55653b2dull, 0xe61acf033d1a45dfull, 0xab70fe17c79ac6caull, 0xff77b1fcbebcdc4full,
+        0xbe5691ef416bd60cull, 0x8dd01fad907ffc3cull, 0xd3515c2831559a83ull, 0x9d71ac8fada6c9b5ull,
+        0xea9c227723ee8bcbull, 0xaecc49914078536dull, 0x823c12795db6ce57ull, 0xc21094364dfb5637ull,
+        0x9096ea6f3848984full, 0xd77485cb25823ac7ull, 0xa086cfcd97bf97f4ull, 0xef340a98172aace5ull,
+        0xb23867fb2a35b28eull, 0x84c8d4dfd2c63f3bull, 0xc5dd44271ad3cdbaull, 0x936b9fcebb25c996ull,
+        0xdbac6c247d62a584ull, 0xa3ab66580d5fdaf6ull, 0xf3e2f893dec3f126ull, 0xb5b5ada8aaff80b8ull,
+        0x87625f056c7c4a8bull, 0xc9bcff6034c13053ull, 0x964e858c91ba2655ull, 0xdff9772470297ebdull,
+        0xa6dfbd9fb8e5b88full, 0xf8a95fcf88747d94ull, 0xb94470938fa89bcfull, 0x8a08f0f8bf0f156bull,
+        0xcdb02555653131b6ull, 0x993fe2c6d07b7facull, 0xe45c10c42a2b3b06ull, 0xaa242499697392d3ull,
+        0xfd87b5f28300ca0eull, 0xbce5086492111aebull, 0x8cbccc096f5088ccull, 0xd1b71758e219652cull,
+        0x9c40000000000000ull, 0xe8d4a51000000000ull, 0xad78ebc5ac620000ull, 0x813f3978f8940984ull,
+        0xc097ce7bc90715b3ull, 0x8f7e32ce7bea5c70ull, 0xd5d238a4abe98068ull, 0x9f4f2726179a2245ull,
+        0xed63a231d4c4fb27ull, 0xb0de65388cc8ada8ull, 0x83c7088e1aab65dbull, 0xc45d1df942711d9aull,
+        0x924d692ca61be758ull, 0xda01ee641a708deaull, 0xa26da3999aef774aull, 0xf209787bb47d6b85ull,
+        0xb454e4a179dd1877ull, 0x865b86925b9bc5c2ull, 0xc83553c5c8965d3dull, 0x952ab45cfa97a0b3ull,
+        0xde469fbd99a05fe3ull, 0xa59bc234db398c25ull, 0xf6c69a72a3989f5cull, 0xb7dcbf5354e9beceull,
+        0x88fcf317f22241e2ull, 0xcc20ce9bd35c78a5ull, 0x98165af37b2153dfull, 0xe2a0b5dc971f303aull,
+        0xa8d9d1535ce3b396ull, 0xfb9b7cd9a4a7443cull, 0xbb764c4ca7a44410ull, 0x8bab8eefb6409c1aull,
+        0xd01fef10a657842cull, 0x9b10a4e5e9913129ull, 0xe7109bfba19c0c9dull, 0xac2820d9623bf429ull,
+        0x80444b5e7aa7cf85ull, 0xbf21e44003acdd2dull, 0x8e679c2f5e44ff8full, 0xd433179d9c8cb841ull,
+        0x9e19db92b4e31ba9ull, 0xeb96bf6ebadf77d9ull, 0xaf87023b9bf0ee6bull
+        };
+        static const int16_t exponents[] = {
+        -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007,  -980,  -954,  -927,
+         -901,  -874,  -847,  -821,  -794,  -768,  -741,  -715,  -688,  -661,  -635,  -608,
+         -582,  -555,  -529,  -502,  -475,  -449,  -422,  -396,  -369,  -343,  -316,  -289,
+         -263,  -236,  -210,  -183,  -157,  -130,  -103,   -77,   -50,   -24,     3,    30,
+           56,    83,   109,   136,   162,   189,   216,   242,   269,   295,   322,   348,
+          375,   402,   428,   455,   481,   508,   534,   561,   588,   614,   641,   667,
+          694,   720,   747,   774,   800,   827,   853,   880,   907,   933,   960,   986,
+         1013,  1039,  1066
+        };
+        return DiyFp(significands[index], exponents[index]);
+    }
 
-            while (isdigit(format[index + count]))
-                ++count;
+    // cached power [c] such that the exponent of w * c is in [-60, -32]; c ~ 10^-k
+    DiyFp cached_power_for(int e, int& k)
+    {
+        double dk = (-61 - e) * 0.30102999566398114 + 347;
+        int ik = static_cast<int>(dk);
+        if (dk - ik > 0.0)
+            ++ik;
+
+        int index = (ik >> 3) + 1;
+        k = -(-348 + (index << 3));
+        return cached_power(index);
+    }
 
-            f.precision = std::stoi(format.substr(index, count));
-            index += count;
-        }
+    const uint64_t pow10[] = {
+        1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+        1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull,
+        100000000000000ull, 1000000000000000ull, 10000000000000000ull, 100000000000000000ull,
+        1000000000000000000ull, 10000000000000000000ull
+    };
 
-        if (index == static_cast<int>(format.size()))
-            return f;
+    // up to 10 digits of the integral part
+    int count_decimal_digits(uint32_t n)
+    {
+        int count = 1;
+        while (count < 10 && n >= pow10[count])
+            ++count;
+        return count;
+    }
 
-        // [type]
-        if (char_in_set(format[index], types))
+    void grisu_round(char* buffer, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+    {
+        while (rest < wp_w && delta - rest >= ten_kappa &&
+               (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w))
         {
-            f.type = format[index];
+            buffer[len - 1]--;
+            rest += ten_kappa;
+        }
+    }
+
+    void digit_gen(const DiyFp& w, const DiyFp& mp, uint64_t delta, char* buffer, int& len, int& k)
+    {
+        const DiyFp one(1ull << -mp.e, mp.e);
+        const DiyFp wp_w = mp - w;
+        uint32_t p1 = static_cast<uint32_t>(mp.f >> -one.e);
+        uint64_t p2 = mp.f & (one.f - 1);
+        int kappa = count_decimal_digits(p1);
+        len = 0;
+
+        while (kappa > 0)
+        {
+            uint32_t d = static_cast<uint32_t>(p1 / pow10[kappa - 1]);
+            p1 = static_cast<uint32_t>(p1 % pow10[kappa - 1]);
+
+            if (d != 0 || len != 0)
+                buffer[len++] = static_cast<char>('0' + d);
 
-            if (type == vl::d_::VT_Other && !char_in_set(f.type, other_types))
+            --kappa;
+            uint64_t tmp = (static_cast<uint64_t>(p1) << -one.e) + p2;
+
+            if (tmp <= delta)
             {
-                assert(false && "Incorrect format for non-number type");
-                throw vl::format_error("Incorrect format for non-number type");
+                k += kappa;
+                grisu_round(buffer, len, delta, tmp, pow10[kappa] << -one.e, wp_w.f);
+                return;
             }
+        }
+
+        for (;;)
+        {
+            p2 *= 10;
+            delta *= 10;
+            char d = static_cast<char>(p2 >> -one.e);
 
-            if (type == vl::d_::VT_Integral && !char_in_set(f.type, int_types))
+            if (d != 0 || len != 0)
+                buffer[len++] = static_cast<char>('0' + d);
+
+            p2 &= one.f - 1;
+            --kappa;
+
+            if (p2 < delta)
             {
-                assert(false && "Incorrect format for integral type");
-                throw vl::format_error("Incorrect format for integral type");
+                k += kappa;
+                int index = -kappa;
+                grisu_round(buffer, len, delta, p2, one.f, wp_w.f * (index < 20 ? pow10[index] : 0));
+                return;
             }
+        }
+    }
+
+    /*
+     * Writes shortest digits of positive finite [value] to [buffer], value = digits * 10^k.
+     * [single] selects the rounding boundaries of float instead of double.
+     */
+    void shortest_digits(double value, bool single, char* buffer, int& len, int& k)
+    {
+        int significand_size = 52;
+        int exponent_bias = 1075;
+        uint64_t significand = 0;
+        int biased_exponent = 0;
+
+        if (single)
+        {
+            float f = static_cast<float>(value);
+            uint32_t bits;
+            memcpy(&bits, &f, sizeof(bits));
+            significand_size = 23;
+            exponent_bias = 150;
+            significand = bits & 0x7FFFFFu;
+            biased_exponent = static_cast<int>((bits >> 23) & 0xFF);
+        }
+        else
+        {
+            uint64_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            significand = bits & 0xFFFFFFFFFFFFFull;
+            biased_exponent = static_cast<int>((bits >> 52) & 0x7FF);
+        }
+
+        uint64_t hidden_bit = 1ull << significand_size;
+        DiyFp v(significand, 1 - exponent_bias);
+        if (biased_exponent != 0)
+            v = DiyFp(significand + hidden_bit, biased_exponent - exponent_bias);
+
+        // boundaries are halfway to the neighbouring values; the lower neighbour is
+        // closer at powers of two, except for the smallest normal value whose lower
+        // neighbour is the largest subnormal, one 2^-1074 (2^-149 for float) away
+        bool lower_closer = significand == 0 && biased_exponent > 1;
+        DiyFp plus = DiyFp((v.f << 1) + 1, v.e - 1).normalized();
+        DiyFp minus = lower_closer ? DiyFp((v.f << 2) - 1, v.e - 2) : DiyFp((v.f << 1) - 1, v.e - 1);
+        minus.f <<= minus.e - plus.e;
+        minus.e = plus.e;
+
+        const DiyFp c_mk = cached_power_for(plus.e, k);
+        const DiyFp w = v.normalized() * c_mk;
+        DiyFp wp = plus * c_mk;
+        DiyFp wm = minus * c_mk;
+        wm.f++;
+        wp.f--;
+        digit_gen(w, wp, wp.f - wm.f, buffer, len, k);
+    }
+
+    // lays out shortest digits like Python's repr, but without ".0" for integral values
+    size_t write_shortest(char* out, const char* digits, int len, int k)
+    {
+        char* p = out;
+        int exp10 = len + k - 1;  // exponent of the first digit
 
-            if (type == vl::d_::VT_Floating && !char_in_set(f.type, float_types))
+        if (exp10 < -4 || exp10 >= 16)
+        {
+            *p++ = digits[0];
+            if (len > 1)
             {
-                assert(false && "Incorrect format for floating type");
-                throw vl::format_error("Incorrect format for floating type");
+                *p++ = '.';
+                memcpy(p, digits + 1, len - 1);
+                p += len - 1;
             }
 
-            ++index;
+            *p++ = 'e';
+            *p++ = exp10 < 0 ? '-' : '+';
+            unsigned int e = static_cast<unsigned int>(exp10 < 0 ? -exp10 : exp10);
+            if (e >= 100)
+                *p++ = static_cast<char>('0' + e / 100);
+            *p++ = digit_pairs[(e % 100) * 2];
+            *p++ = digit_pairs[(e % 100) * 2 + 1];
         }
-
-        if (index != static_cast<int>(format.size()))
+        else if (k >= 0)
+        {
+            memcpy(p, digits, len);
+            p += len;
+            memset(p, '0', k);
+            p += k;
+        }
+        else if (exp10 >= 0)
         {
-            assert(false && "Unknown symbols in format specifier");
-            throw vl::format_error("Unknown symbols in format specifier");
+            memcpy(p, digits, exp10 + 1);
+            p += exp10 + 1;
+            *p++ = '.';
+            memcpy(p, digits + exp10 + 1, len - exp10 - 1);
+            p += len - exp10 - 1;
+        }
+        else
+        {
+            *p++ = '0';
+            *p++ = '.';
+            memset(p, '0', -exp10 - 1);
+            p += -exp10 - 1;
+            memcpy(p, digits, len);
+            p += len;
         }
 
-        return f;
+        return static_cast<size_t>(p - out);
     }
 }
 
-void vl::d_::modify_stream(std::ostringstream& oss, const std::string& format, ValueType type)
+
+void vl::d_::format_integer(OutputBuffer& out, const FormatSpec& spec, unsigned long long magnitude, bool negative)
 {
-    Format f = parse_format(format, type);
+    check_spec(spec, VT_Integral);
+
+    // 64 binary digits or 20 decimal digits with separators
+    char buf[72];
+    char* end = buf + sizeof(buf);
+    char* digits = nullptr;
+    const char* prefix = "";
+
+    switch (spec.type)
+    {
+    case 'x':
+        digits = write_power_of_two(end, magnitude, 4, "0123456789abcdef");
+        prefix = "0x";
+        break;
+
+    case 'X':
+        digits = write_power_of_two(end, magnitude, 4, "0123456789ABCDEF");
+        prefix = "0X";
+        break;
+
+    case 'o':
+        digits = write_power_of_two(end, magnitude, 3, "01234567");
+        prefix = magnitude != 0 ? "0" : "";
+        break;
+
+    case 'b':
+        digits = write_power_of_two(end, magnitude, 1, "01");
+        prefix = "0b";
+        break;
+
+    case 'd':
+    default:
+        digits = spec.thousands ? write_grouped_decimal(end, magnitude) : write_decimal(end, magnitude);
+        break;
+    }
+
+    if (!spec.alternate)
+        prefix = "";
+
+    write_number(out, spec, number_sign(spec, negative), prefix, strlen(prefix), digits, static_cast<size_t>(end - digits));
+}
+
+
+void vl::d_::format_float(OutputBuffer& out, const FormatSpec& spec, double value, bool single)
+{
+    check_spec(spec, VT_Floating);
+
+    bool negative = std::signbit(value) && !std::isnan(value);
+    char sign = number_sign(spec, negative);
+    value = std::fabs(value);
+
+    bool upper = spec.type == 'E' || spec.type == 'F' || spec.type == 'G';
+
+    if (std::isinf(value) || std::isnan(value))
+    {
+        const char* text = std::isinf(value) ? (upper ? "INF" : "inf") : (upper ? "NAN" : "nan");
+        write_number(out, spec, sign, "", 0, text, 3);
+        return;
+    }
+
+    // default presentation is the shortest representation that reads back the same
+    if (spec.type == '\0' && spec.precision == -1)
+    {
+        char digits[24];
+        char buf[32];
+        int len = 1;
+        int k = 0;
+        digits[0] = '0';
+
+        if (value != 0.0)
+            shortest_digits(value, single, digits, len, k);
+
+        write_number(out, spec, sign, "", 0, buf, write_shortest(buf, digits, len, k));
+        return;
+    }
+
+    // exact fixed/scientific/general digits come from the C library, layout is ours
+    char conversion = spec.type;
+    const char* suffix = "";
+
+    if (conversion == '\0')
+    {
+        conversion = 'g';
+    }
+    else if (conversion == '%')
+    {
+        conversion = 'f';
+        value *= 100;
+        suffix = "%";
+    }
+
+    char format[8];
+    char* f = format;
+    *f++ = '%';
+    if (spec.alternate)
+        *f++ = '#';
+    *f++ = '.';
+    *f++ = '*';
+    *f++ = conversion;
+    *f = '\0';
+
+    int precision = spec.precision != -1 ? spec.precision : 6;
+    char stack_buf[512];
+    std::vector<char> heap_buf;
+    char* buf = stack_buf;
+
+    int size = snprintf(buf, sizeof(stack_buf), format, precision, value);
+
+    if (size < 0)
+    {
+        assert(false && "Error formatting floating point number");
+        throw vl::format_error("Error formatting floating point number");
+    }
+
+    // huge values in fixed notation or huge precision
+    if (static_cast<size_t>(size) + 2 > sizeof(stack_buf))
+    {
+        heap_buf.resize(size + 2);
+        buf = &heap_buf[0];
+        snprintf(buf, heap_buf.size(), format, precision, value);
+    }
+
+    // printf follows LC_NUMERIC, output does not
+    const char* point = localeconv()->decimal_point;
+    if (point[0] != '.' || point[1] != '\0')
+    {
+        size_t point_size = strlen(point);
+        char* found = point_size != 0 ? strstr(buf, point) : nullptr;
+
+        if (found != nullptr)
+        {
+            *found = '.';
+            memmove(found + 1, found + point_size, strlen(found + point_size) + 1);
+            size -= static_cast<int>(point_size - 1);
+        }
+    }
+
+    size_t suffix_size = strlen(suffix);
+    memcpy(buf + size, suffix, suffix_size);
+
+    write_number(out, spec, sign, "", 0, buf, size + suffix_size);
+}
+
+
+void vl::d_::format_string(OutputBuffer& out, const FormatSpec& spec, const char* s, size_t n)
+{
+    check_spec(spec, VT_Other);
+
+    if (spec.precision != -1 && static_cast<size_t>(spec.precision) < n)
+        n = spec.precision;
+
+    size_t padding = static_cast<size_t>(spec.width) > n ? spec.width - n : 0;
+    size_t before = 0;
+
+    if (spec.align == '>' || spec.align == '=')
+        before = padding;
+    else if (spec.align == '^')
+        before = padding / 2;
+
+    out.append(before, spec.fill);
+    out.append(s, n);
+    out.append(padding - before, spec.fill);
+}
+
+
+void vl::d_::modify_stream(std::ostringstream& oss, const FormatSpec& f, ValueType type)
+{
+    check_spec(f, type);
 
     switch (f.type)
     {
@@ -407,28 +1052,6 @@ void vl::d_::modify_stream(std::ostringstream& oss, const std::string& format, V
         // not implemented
         break;
 
-    // Floating point presentation types:
-    case 'E':
-        oss << std::uppercase;
-    case 'e':
-        oss << std::scientific;
-        break;
-
-    case 'F':
-        oss << std::uppercase;
-    case 'f':
-        oss << std::fixed;
-        break;
-
-    case 'G':
-    case 'g':
-        // default
-        break;
-
-    case '%':
-        // not impelemented
-        break;
-
     // String and default presentation types
     case 's':
     default:
@@ -437,27 +1060,22 @@ void vl::d_::modify_stream(std::ostringstream& oss, const std::string& format, V
 
     switch (f.sign)
     {
-    case S_Both:
+    case '+':
         oss << std::showpos;
         break;
 
-    case S_Space:
+    case ' ':
         // not implemented
         break;
 
-    case S_Negative:
+    case '-':
     default:
         // default
         break;
     }
 
-    if (f.alternate_form)
-    {
-        if (type == VT_Integral)
-            oss << std::showbase;
-        else if (type == VT_Floating)
-            oss << std::showpoint;
-    }
+    if (f.alternate && type == VT_Integral)
+        oss << std::showbase;
 
     if (f.width != 0)
     {
@@ -468,28 +1086,37 @@ void vl::d_::modify_stream(std::ostringstream& oss, const std::string& format, V
 
         switch (f.align)
         {
-        case A_Left:
+        case '<':
             oss << std::left;
             break;
 
-        case A_Right:
+        case '>':
             oss << std::right;
             break;
 
-        case A_Center:
+        case '^':
             // not implemented
             break;
 
-        case A_SignAware:
+        case '=':
             oss << std::internal;
             break;
 
+        case '\0':
+            // left for text, right for numbers
+            if (type == VT_Other)
+                oss << std::left;
+            else
+                oss << std::right;
+            break;
+
         default:
             assert(0 && "impossible");
             break;
         }
     }
 
+    // floating values printed by user types' operator<< still honor it
     if (f.precision != -1)
         oss << std::setprecision(f.precision);
 }
@@ -0,0 +1,56 @@
+/*
+ *  Copyright (c) 2013, Vitalii Turinskyi
+ *  All rights reserved.
+ *
+ *  Distributed under the Boost Software License, Version 1.0. (See accompanying
+ *  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+ */
+// built with -DVL_ACTIVE_LEVEL=VL_LEVEL_WARNING, library included
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include "VariadicLogger/Logger.h"
+
+#include <sstream>
+#include <type_traits>
+
+
+TEST_CASE( "Compiled out levels" )
+{
+    REQUIRE( VL_ACTIVE_LEVEL == VL_LEVEL_WARNING );
+
+    std::stringstream* output = new std::stringstream;
+    vl::ImLogger l("level");
+    l.set_pattern("%v");
+    l.add_stream(output, vl::debug);
+
+    // the debug stream does not enable what is compiled out
+    CHECK_FALSE( l.should_log(vl::debug) );
+    CHECK_FALSE( l.should_log(vl::info) );
+    CHECK( l.should_log(vl::warning) );
+
+    int evaluated = 0;
+    auto evaluate = [&]() { return ++evaluated; };
+
+    VL_DEBUG(l, "debug {0}", evaluate());
+    VL_INFO(l, "info {0}", evaluate());
+    VL_DEBUG_STREAM(l) << evaluate();
+    VL_INFO_STREAM(l) << evaluate();
+    CHECK( evaluated == 0 );
+
+    CHECK(( std::is_same<decltype(l.debug()), vl::d_::NullWorker>::value ));
+    CHECK(( std::is_same<decltype(l.info()), vl::d_::NullWorker>::value ));
+    CHECK(( std::is_same<decltype(l.warning()), vl::d_::LogWorker<vl::immediate> >::value ));
+
+    l.debug() << "debug" << 1 << std::hex << std::endl;
+    l.info() << "info";
+    l.debug("debug {0}", 1);
+    l.log(vl::info, "info {0}", 1);
+    CHECK( output->str().empty() );
+
+    VL_WARNING(l, "warning {0}", evaluate());
+    VL_ERROR_STREAM(l) << "error";
+    l.warning() << "stream";
+    CHECK( evaluated == 1 );
+    CHECK( output->str() == "warning 1\nerror \nstream \n" );
+}
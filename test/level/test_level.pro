@@ -0,0 +1,44 @@
+# The following block leaves managing debug/release configuration to qt creator.
+CONFIG -= debug_and_release
+CONFIG( debug, debug|release ) {
+  CONFIG -= release
+} else {
+  CONFIG -= debug
+  CONFIG += release
+}
+
+TEMPLATE = app
+CONFIG -= qt
+CONFIG += console
+TARGET = ../../TestLoggerLevel
+
+!win32 {
+    QMAKE_CXXFLAGS += -std=c++0x
+    LIBS += -lpthread
+}
+
+INCLUDEPATH += \
+    ../../include/ \
+    ../
+
+# VL_ACTIVE_LEVEL has to be the same for the library, so it is built in
+DEFINES += VL_ACTIVE_LEVEL=VL_LEVEL_WARNING
+
+CONFIG( debug, debug|release )  {
+    #DEFINES += _GLIBCXX_DEBUG
+}
+
+CONFIG( release, debug|release )  {
+    DEFINES *= NDEBUG
+}
+
+# Input
+HEADERS += \
+    ../../include/VariadicLogger/SafeSprintf.h \
+    ../../include/VariadicLogger/Logger.h \
+    ../catch.hpp
+
+SOURCES += \
+    ../../src/SafeSprintf.cpp \
+    ../../src/Logger.cpp \
+    test_level.cpp
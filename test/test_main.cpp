@@ -12,8 +12,17 @@
 #include "VariadicLogger/Logger.h"
 
 #include <thread>
+#include <atomic>
 #include <stdio.h>
+#include <ctype.h>
 #include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <random>
+#include <cfloat>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
 
 
 void benchmark()
@@ -47,6 +56,172 @@ void benchmark()
         vl::safe_sprintf(res, "Formatting {0} args: {1} us\n", i, elapsed_ns.count());
         std::cout << res;
     }
+
+    // same formats, parsed at compile time
+#define FILL "abcdefghijklmnopqrstuvwxyz0987654321"
+    for (int i = 0; i < 3; ++i)
+    {
+        std::string out;
+        std::string fill = FILL;
+
+        auto start = std::chrono::high_resolution_clock::now();
+
+        switch (i)
+        {
+            case 0: for (int j=0;j<iter;++j) vl::safe_sprintf(out, VL_FMT(FILL "{0}" FILL), 42); break;
+            case 1: for (int j=0;j<iter;++j) vl::safe_sprintf(out, VL_FMT(FILL "{0}" FILL "{1}" FILL), 42, fill); break;
+            case 2: for (int j=0;j<iter;++j) vl::safe_sprintf(out, VL_FMT(FILL "{0}" FILL "{1}" FILL "{2}" FILL), 42, fill, 42); break;
+        }
+
+        auto end = std::chrono::high_resolution_clock::now();
+        auto elapsed_ns = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+        std::string res;
+        vl::safe_sprintf(res, VL_FMT("Formatting {0} args (static): {1} us\n"), i, elapsed_ns.count());
+        std::cout << res;
+    }
+#undef FILL
+
+    // parsing long static text, the format cache is off so every call parses
+    {
+        std::string out;
+        std::string fill(400, 'x');
+        std::string fmt = fill + "{0}" + fill + "{1}" + fill;
+
+        vl::set_format_cache_capacity(0);
+        auto start = std::chrono::high_resolution_clock::now();
+
+        for (int j=0;j<iter;++j) vl::safe_sprintf(out, fmt, 42, 42);
+
+        auto end = std::chrono::high_resolution_clock::now();
+        auto elapsed_ns = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+        vl::set_format_cache_capacity(1024);
+
+        std::string res;
+        vl::safe_sprintf(res, "Parsing and formatting {0} bytes of text: {1} us\n", fmt.size(), elapsed_ns.count());
+        std::cout << res;
+    }
+
+    // delegate logger throughput by number of producer threads, until all is written
+    const int messages = 200000;
+    unsigned int max_producers = std::max(4u, std::thread::hardware_concurrency());
+    for (int mode = vl::shared_queue; mode <= vl::per_thread_queues; ++mode)
+    for (unsigned int producers = 1; producers <= max_producers; producers *= 2)
+    {
+        auto lm = std::unique_ptr<vl::LogManager>(new vl::LogManager(static_cast<vl::QueueMode>(mode)));
+
+        vl::Logger logger("bench");
+        logger.add_stream(new std::ostream(nullptr), vl::debug);  // discards everything
+
+        auto start = std::chrono::high_resolution_clock::now();
+
+        std::vector<std::thread> threads;
+        for (unsigned int t = 0; t < producers; ++t)
+        {
+            threads.push_back(std::thread([logger, producers]() mutable {
+                for (unsigned int i = 0; i < messages / producers; ++i)
+                    logger.log(vl::info, VL_FMT("message {0} of {1}"), i, 42);
+            }));
+        }
+
+        for (std::thread& thread : threads)
+            thread.join();
+        lm = nullptr;
+
+        auto end = std::chrono::high_resolution_clock::now();
+        auto elapsed_ns = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+        std::string res;
+        vl::safe_sprintf(res, VL_FMT("Logging {0} messages from {1} threads ({2}): {3} us\n"), messages, producers,
+                         mode == vl::shared_queue ? "shared queue" : "per thread queues", elapsed_ns.count());
+        std::cout << res;
+    }
+
+    // writing to a file, where every write and flush is a system call
+    {
+        auto lm = std::unique_ptr<vl::LogManager>(new vl::LogManager);
+
+        vl::Logger logger("bench");
+        logger.add_stream("bench.log", vl::debug);
+
+        auto start = std::chrono::high_resolution_clock::now();
+
+        for (unsigned int i = 0; i < messages; ++i)
+            logger.log(vl::info, VL_FMT("message {0} of {1}"), i, 42);
+        lm = nullptr;
+
+        auto end = std::chrono::high_resolution_clock::now();
+        remove("bench.log");
+
+        auto elapsed_ns = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+        std::string res;
+        vl::safe_sprintf(res, VL_FMT("Logging {0} messages to a file: {1} us\n"), messages, elapsed_ns.count());
+        std::cout << res;
+    }
+
+    // time from logging a message until the writer has written it, with the writer idle in between
+    {
+        struct ArrivalBuffer : std::streambuf
+        {
+            ArrivalBuffer() : arrived(0) { }
+
+            std::streamsize xsputn(const char*, std::streamsize n) { arrived.fetch_add(1); return n; }
+            int overflow(int c) { return c; }
+
+            std::atomic<unsigned int> arrived;
+        };
+
+        const unsigned int round_trips = 2000;
+        ArrivalBuffer sink;
+
+        auto lm = std::unique_ptr<vl::LogManager>(new vl::LogManager);
+
+        vl::Logger logger("bench");
+        logger.add_stream(new std::ostream(&sink), vl::debug);
+
+        std::chrono::high_resolution_clock::duration total(0);
+
+        for (unsigned int i = 0; i < round_trips; ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+
+            auto start = std::chrono::high_resolution_clock::now();
+            logger.log(vl::info, VL_FMT("message {0}"), i);
+            while (sink.arrived.load() == i)
+                std::this_thread::yield();
+            total += std::chrono::high_resolution_clock::now() - start;
+        }
+        lm = nullptr;
+
+        auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(total);
+        std::string res;
+        vl::safe_sprintf(res, VL_FMT("Waking the writer for {0} messages: {1} ns per message\n"),
+                         round_trips, elapsed_ns.count() / round_trips);
+        std::cout << res;
+    }
+
+    // time spent by the logging thread alone, with and without deferred formatting
+    for (int deferred = 0; deferred < 2; ++deferred)
+    {
+        auto lm = std::unique_ptr<vl::LogManager>(new vl::LogManager);
+
+        vl::Logger logger("bench");
+        logger.add_stream(new std::ostream(nullptr), vl::debug);
+        if (deferred)
+            logger.set(vl::deferred);
+
+        auto start = std::chrono::high_resolution_clock::now();
+
+        for (unsigned int i = 0; i < messages; ++i)
+            logger.log(vl::info, VL_FMT("message {0} of {1}: {2:.3f}"), i, "bench", i * 0.5);
+
+        auto end = std::chrono::high_resolution_clock::now();
+        lm = nullptr;
+
+        auto elapsed_ns = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+        std::string res;
+        vl::safe_sprintf(res, VL_FMT("Queueing {0} messages ({1}): {2} us\n"), messages,
+                         deferred ? "formatted by the writer" : "formatted by the caller", elapsed_ns.count());
+        std::cout << res;
+    }
 }
 
 
@@ -221,6 +396,206 @@ TEST_CASE( "Stream logging" )
         l.log(vl::debug, "{0} {1}! {0}! {0}!",  "No", "way");
         CHECK(output->str() == "No way! No! No!\n");
     }
+
+    SECTION ( "static format output" )
+    {
+        l.log(vl::debug, VL_FMT("{0} {1}! {0}!"), "No", "way");
+        l.info(VL_FMT("{0:05}"), 42);
+        CHECK(output->str() == "No way! No!\n00042\n");
+    }
+
+    SECTION ( "long output" )
+    {
+        std::string dump(3000, 'x');
+        l.log(vl::debug, "{0}|{1}", dump, 1);
+        l.log(vl::debug, VL_FMT("{0:y>2000}"), 2);
+        CHECK(output->str() == dump + "|1\n" + std::string(1999, 'y') + "2\n");
+    }
+}
+
+
+TEST_CASE( "Level filtering" )
+{
+    vl::ImLogger l("filtered");
+    CHECK_FALSE( l.should_log(vl::critical) );
+
+    std::stringstream* output = new std::stringstream;
+    l.add_stream(output, vl::warning);
+    l.set(vl::notimestamp);
+    l.set(vl::nothreadid);
+    l.set(vl::nologgername);
+    l.set(vl::nologlevel);
+
+    CHECK( l.should_log(vl::warning) );
+    CHECK_FALSE( l.should_log(vl::info) );
+
+    // disabled messages are not formatted, so the broken format is not reported
+    l.log(vl::debug, "{0", 1);
+    l.info() << "skipped" << std::hex << 15 << std::endl;
+    l.warning() << "written";
+    l.error(VL_FMT("{0}"), 42);
+    CHECK( output->str() == "written \n42\n" );
+
+    l.clear_streams();
+    CHECK_FALSE( l.should_log(vl::critical) );
+
+    vl::ImLogger copy(l);
+    copy.add_stream(new std::stringstream, vl::debug);
+    CHECK( copy.should_log(vl::debug) );
+    CHECK_FALSE( l.should_log(vl::debug) );
+}
+
+
+TEST_CASE( "Thread id" )
+{
+    vl::ImLogger l("threads");
+
+    std::stringstream* output = new std::stringstream;
+    l.add_stream(output, vl::debug);
+    l.set(vl::notimestamp);
+
+    l.log(vl::info, "main");
+    std::thread([&l] { l.warning() << "other"; }).join();
+    l.log(vl::critical, "main");
+
+    std::string main_line, other_line, again_line;
+    std::getline(*output, main_line);
+    std::getline(*output, other_line);
+    std::getline(*output, again_line);
+
+    std::ostringstream main_id;
+    main_id << "0x" << std::hex << std::this_thread::get_id() << ' ';
+
+    CHECK( main_line == "[threads] " + main_id.str() + "<Info> main" );
+    CHECK( again_line == "[threads] " + main_id.str() + "<Critical> main" );
+    CHECK( other_line.compare(0, 12, "[threads] 0x") == 0 );
+    CHECK( other_line.find(main_id.str()) == std::string::npos );
+    CHECK( other_line.substr(other_line.size() - 16) == "<Warning> other " );
+}
+
+
+TEST_CASE( "Timestamp" )
+{
+    vl::ImLogger l("timestamp");
+
+    std::stringstream* output = new std::stringstream;
+    l.add_stream(output, vl::debug);
+    l.set(vl::nothreadid);
+    l.set(vl::nologgername);
+    l.set(vl::nologlevel);
+
+    l.log(vl::debug, "first");
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    l.log(vl::debug, "second");
+
+    std::string line;
+    std::getline(*output, line);
+    std::string first = line;
+    std::getline(*output, line);
+    std::string second = line;
+
+    // "YYYY-mm-dd HH:MM:SS[mmm] message"
+    const std::string layout = "dddd-dd-dd dd:dd:dd[ddd] ";
+    REQUIRE( first.size() == layout.size() + 5 );
+    REQUIRE( second.size() == layout.size() + 6 );
+
+    for (size_t i = 0; i < layout.size(); ++i)
+    {
+        if (layout[i] == 'd')
+            CHECK( isdigit(static_cast<unsigned char>(first[i])) != 0 );
+        else
+            CHECK( first[i] == layout[i] );
+    }
+
+    CHECK( first.substr(layout.size()) == "first" );
+    CHECK( first.substr(0, layout.size()) < second.substr(0, layout.size()) );
+}
+
+
+TEST_CASE( "Message pattern" )
+{
+    vl::ImLogger l("pattern");
+
+    std::stringstream* output = new std::stringstream;
+    l.add_stream(output, vl::debug);
+
+    CHECK( l.set_pattern("%l|%n|%v|%%|%t") );
+    l.log(vl::info, "hello");
+
+    std::ostringstream thread_id;
+    thread_id << "0x" << std::hex << std::this_thread::get_id();
+    CHECK( output->str() == "Info|pattern|hello|%|" + thread_id.str() + "\n" );
+
+    CHECK_FALSE( l.set_pattern("%q %v") );
+    CHECK_FALSE( l.set_pattern("%v %v") );
+    CHECK_FALSE( l.set_pattern("%v %") );
+
+    output->str("");
+    l.set(vl::noendl);
+    l.warning() << "still" << "set";
+    CHECK( output->str() == "Warning|pattern|still set |%|" + thread_id.str() );
+
+    output->str("");
+    l.unset(vl::noendl);
+    CHECK( l.set_pattern("%Y-%m-%dT%H:%M:%S.%f %v") );
+    l.log(vl::debug, "iso");
+
+    const std::string layout = "dddd-dd-ddTdd:dd:dd.ddd iso\n";
+    std::string line = output->str();
+    REQUIRE( line.size() == layout.size() );
+    for (size_t i = 0; i < layout.size(); ++i)
+    {
+        if (layout[i] == 'd')
+            CHECK( isdigit(static_cast<unsigned char>(line[i])) != 0 );
+        else
+            CHECK( line[i] == layout[i] );
+    }
+
+    output->str("");
+    l.set(vl::notimestamp);
+    l.set(vl::nothreadid);
+    CHECK( l.set_pattern("") );
+    l.log(vl::error, "default");
+    CHECK( output->str() == "[pattern] <Error> default\n" );
+}
+
+
+namespace
+{
+    int evaluations = 0;
+
+    int counted(int value)
+    {
+        ++evaluations;
+        return value;
+    }
+}
+
+TEST_CASE( "Logging macros" )
+{
+    vl::ImLogger l("macros");
+
+    std::stringstream* output = new std::stringstream;
+    l.add_stream(output, vl::info);
+    l.set(vl::notimestamp);
+    l.set(vl::nothreadid);
+    l.set(vl::nologgername);
+
+    evaluations = 0;
+    VL_DEBUG(l, "{0}", counted(1));
+    VL_DEBUG_STREAM(l) << counted(2);
+    CHECK( evaluations == 0 );
+
+    VL_INFO(l, "{0}", counted(3));
+    VL_ERROR(l, VL_FMT("{0} {1}"), counted(4), "x");
+    VL_LOG(l, vl::warning, "no arguments");
+    if (evaluations == 2)
+        VL_WARNING_STREAM(l) << counted(5);
+    else
+        l.critical() << "unexpected";
+    CHECK( evaluations == 3 );
+
+    CHECK( output->str() == "<Info> 3\n<Error> 4 x\n<Warning> no arguments\n<Warning> 5 \n" );
 }
 
 
@@ -280,6 +655,806 @@ TEST_CASE( "deffered logging" )
 }
 
 
+TEST_CASE( "deffered logging from many threads" )
+{
+    const int producers = 8;
+    const int messages = 2000;
+
+    vl::QueueMode mode = vl::shared_queue;
+    vl::WriterMode writers = vl::single_writer;
+    SECTION( "shared queue" ) { mode = vl::shared_queue; }
+    SECTION( "per thread queues" ) { mode = vl::per_thread_queues; }
+    SECTION( "writer per sink" ) { writers = vl::writer_per_sink; }
+
+    auto lm = std::unique_ptr<vl::LogManager>(new vl::LogManager(mode, vl::QueueLimits(), writers));
+
+    vl::Logger l("default");
+    l.set(vl::notimestamp);
+    l.set(vl::nothreadid);
+    l.set(vl::nologgername);
+    l.set(vl::nologlevel);
+
+    std::stringstream* output = new std::stringstream;
+    l.add_stream(output, vl::debug);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < producers; ++t)
+    {
+        threads.push_back(std::thread([l, t]() mutable {
+            for (int i = 0; i < messages; ++i)
+                l.log(vl::debug, VL_FMT("{0} {1}"), t, i);
+        }));
+    }
+
+    for (std::thread& thread : threads)
+        thread.join();
+
+    lm = nullptr;
+
+    // every message arrives once and in order per producer
+    std::vector<int> next(producers, 0);
+    int t = 0, i = 0, total = 0, out_of_order = 0;
+    while (*output >> t >> i)
+    {
+        if (t < 0 || t >= producers || i != next[t])
+            ++out_of_order;
+        else
+            next[t] = i + 1;
+        ++total;
+    }
+    CHECK( out_of_order == 0 );
+    CHECK( total == producers * messages );
+}
+
+
+TEST_CASE( "per thread queues" )
+{
+    std::stringstream* output = new std::stringstream;
+
+    vl::Logger l("default");
+    l.set(vl::notimestamp);
+    l.set(vl::nothreadid);
+    l.set(vl::nologgername);
+    l.set(vl::nologlevel);
+    l.add_stream(output, vl::debug);
+
+    // the main thread's ring belongs to the first manager, the second one gets a new one
+    for (int manager = 0; manager < 2; ++manager)
+    {
+        auto lm = std::unique_ptr<vl::LogManager>(new vl::LogManager(vl::per_thread_queues));
+
+        l.log(vl::debug, "first {0}", manager);
+
+        // short-lived threads, each with its own ring, logging after each other
+        for (int t = 0; t < 20; ++t)
+            std::thread([l, t]() mutable { l.log(vl::debug, "thread {0}", t); }).join();
+
+        l.log(vl::debug, "last {0}", manager);
+
+        // more messages than a ring holds, the producer waits for the writer
+        for (int i = 0; i < 3000; ++i)
+            l.log(vl::debug, "x");
+    }
+
+    std::string expected;
+    for (int manager = 0; manager < 2; ++manager)
+    {
+        expected += vl::safe_sprintf_ret("first {0}\n", manager);
+        for (int t = 0; t < 20; ++t)
+            expected += vl::safe_sprintf_ret("thread {0}\n", t);
+        expected += vl::safe_sprintf_ret("last {0}\n", manager);
+        for (int i = 0; i < 3000; ++i)
+            expected += "x\n";
+    }
+
+    CHECK( output->str() == expected );
+}
+
+
+struct Streamed
+{
+    int value;
+};
+
+std::ostream& operator<<(std::ostream& os, const Streamed& s)
+{
+    return os << "streamed " << s.value;
+}
+
+
+TEST_CASE( "Deferred formatting" )
+{
+    std::stringstream* eager_output = new std::stringstream;
+    std::stringstream* deferred_output = new std::stringstream;
+
+    // same layout, only the second one defers formatting to the writer thread
+    vl::Logger eager("name");
+    eager.set_pattern("<%l> [%n] %t %v |%n|");
+    eager.add_stream(eager_output, vl::debug);
+
+    vl::Logger deferred("name");
+    deferred.set_pattern("<%l> [%n] %t %v |%n|");
+    deferred.set(vl::deferred);
+    deferred.add_stream(deferred_output, vl::debug);
+
+    auto lm = std::unique_ptr<vl::LogManager>(new vl::LogManager);
+
+    auto log = [](vl::Logger& l) {
+        const char* null_str = nullptr;
+        char buf[] = "mutable";
+
+        l.log(vl::info, VL_FMT("{0} {1:.2f} {2} {3:>4}"), 42, 3.14159, 'c', -7);
+        l.log(vl::warning, VL_FMT("{0}|{1:<10}|{2}|{3}"), "literal", std::string("temporary"), null_str, buf);
+        l.log(vl::error, VL_FMT("{0} and {1}"), Streamed{ 1 }, 2);
+        l.log(vl::debug, VL_FMT("{0}"), std::string(3000, 'x'));
+        l.log(vl::critical, VL_FMT("no arguments"));
+        l.log(vl::debug, "runtime {0}", 1);
+    };
+
+    // thread ids are captured from the logging thread, not the writer
+    std::thread([&]() { log(eager); log(deferred); }).join();
+
+    lm.reset();
+
+    CHECK( deferred_output->str() == eager_output->str() );
+    CHECK( deferred_output->str().find("42 3.14 c   -7 |name|") != std::string::npos );
+    CHECK( deferred_output->str().find("literal|temporary |(null)|mutable") != std::string::npos );
+    CHECK( deferred_output->str().find("streamed 1 and 2") != std::string::npos );
+
+    // timestamps are captured too
+    std::stringstream* timed_output = new std::stringstream;
+    vl::Logger timed("timed");
+    timed.set(vl::deferred);
+    timed.add_stream(timed_output, vl::debug);
+
+    lm.reset(new vl::LogManager);
+    timed.log(vl::info, VL_FMT("{0}"), 1);
+    lm.reset();
+
+    std::string line = timed_output->str();
+    REQUIRE( line.size() > 26 );
+    CHECK( line[4] == '-' );
+    CHECK( line[19] == '[' );
+    CHECK( line.substr(line.size() - 3) == " 1\n" );
+}
+
+
+// sink whose writes wait while it is stalled, like a disk that stopped responding
+struct StallingBuffer : std::stringbuf
+{
+    StallingBuffer() : stalled(true), entered(false), writes(0), flushes(0) { }
+
+    std::streamsize xsputn(const char* s, std::streamsize n)
+    {
+        entered.store(true);
+        while (stalled.load())
+            std::this_thread::yield();
+        ++writes;
+        return std::stringbuf::xsputn(s, n);
+    }
+
+    int sync()
+    {
+        ++flushes;
+        return std::stringbuf::sync();
+    }
+
+    std::atomic<bool> stalled;
+    std::atomic<bool> entered;
+    int writes;   // written by the writer thread only
+    int flushes;
+};
+
+
+void check_bounded_queue(vl::QueueMode mode)
+{
+    StallingBuffer sink;
+
+    vl::Logger l("default");
+    l.set(vl::notimestamp);
+    l.set(vl::nothreadid);
+    l.set(vl::nologgername);
+    l.set(vl::nologlevel);
+    l.add_stream(new std::ostream(&sink), vl::debug);
+
+    vl::QueueLimits limits;
+    limits.max_messages = 4;
+
+    // first message is held by the stalled writer and still takes room
+    auto stall = [&]() {
+        l.log(vl::debug, "0");
+        while (!sink.entered.load())
+            std::this_thread::yield();
+    };
+
+    SECTION( "drop newest" )
+    {
+        limits.policy = vl::drop_newest;
+        auto lm = std::unique_ptr<vl::LogManager>(new vl::LogManager(mode, limits));
+        stall();
+
+        for (int i = 1; i <= 10; ++i)
+            l.log(vl::debug, "{0}", i);
+
+        sink.stalled.store(false);
+        lm.reset();
+        CHECK( sink.str() == "0\n1\n2\n3\nVariadicLogger: 7 messages dropped, log queue was full\n" );
+    }
+
+    SECTION( "drop oldest" )
+    {
+        limits.policy = vl::drop_oldest;
+        auto lm = std::unique_ptr<vl::LogManager>(new vl::LogManager(mode, limits));
+        stall();
+
+        for (int i = 1; i <= 10; ++i)
+            l.log(vl::debug, "{0}", i);
+
+        sink.stalled.store(false);
+        lm.reset();
+        CHECK( sink.str() == "0\n8\n9\n10\nVariadicLogger: 7 messages dropped, log queue was full\n" );
+    }
+
+    SECTION( "drop below level" )
+    {
+        limits.max_messages = 2;
+        limits.policy = vl::drop_below_level;
+        limits.drop_level = vl::warning;
+        auto lm = std::unique_ptr<vl::LogManager>(new vl::LogManager(mode, limits));
+        stall();
+
+        l.log(vl::info, "1");
+        l.log(vl::info, "2");
+        l.log(vl::debug, "3");
+
+        // waits for room instead of being dropped
+        std::thread producer([l]() mutable { l.log(vl::error, "4"); });
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        sink.stalled.store(false);
+        producer.join();
+        lm.reset();
+
+        std::string out = sink.str();
+        CHECK( out.find("0\n1\n") == 0 );
+        CHECK( out.find("\n4\n") != std::string::npos );
+        CHECK( out.find("2 messages dropped") != std::string::npos );
+        CHECK( out.size() == std::string("0\n1\n4\nVariadicLogger: 2 messages dropped, log queue was full\n").size() );
+    }
+
+    SECTION( "block producer" )
+    {
+        limits.max_messages = 0;
+        limits.max_bytes = 64;
+        sink.stalled.store(false);
+        auto lm = std::unique_ptr<vl::LogManager>(new vl::LogManager(mode, limits));
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+            threads.push_back(std::thread([l]() mutable {
+                for (int i = 0; i < 500; ++i)
+                    l.log(vl::debug, "message");
+            }));
+        for (std::thread& thread : threads)
+            thread.join();
+
+        lm.reset();
+        CHECK( sink.str().size() == 4 * 500 * std::string("message\n").size() );
+    }
+}
+
+
+TEST_CASE( "Bounded queue" )
+{
+    SECTION( "shared queue" ) { check_bounded_queue(vl::shared_queue); }
+    SECTION( "per thread queues" ) { check_bounded_queue(vl::per_thread_queues); }
+}
+
+
+// each message goes to the streams of a logger destroyed right after it, so
+// the writer releases them while producers are still evicting their messages
+void check_drop_reports(vl::QueueMode mode)
+{
+    vl::QueueLimits limits;
+    limits.max_messages = 1;
+    limits.policy = vl::drop_oldest;
+    auto lm = std::unique_ptr<vl::LogManager>(new vl::LogManager(mode, limits));
+
+    const int threads = 4;
+    const int messages = 500;
+    std::vector<std::stringbuf> outputs(threads * messages);
+
+    std::vector<std::thread> producers;
+    for (int t = 0; t < threads; ++t)
+    {
+        producers.push_back(std::thread([&outputs, t]() {
+            for (int i = 0; i < messages; ++i)
+            {
+                vl::Logger l("short-lived");
+                l.set_pattern("%v");
+                l.add_stream(new std::ostream(&outputs[t * messages + i]), vl::debug);
+                l.log(vl::info, "message");
+            }
+        }));
+    }
+
+    for (std::thread& producer : producers)
+        producer.join();
+    lm.reset();
+
+    // a report goes to the streams of the last message it counts, whose own
+    // message was dropped, so every output holds either one or the other
+    unsigned long written = 0;
+    unsigned long dropped = 0;
+    unsigned long misrouted = 0;
+    for (std::stringbuf& output : outputs)
+    {
+        std::string text = output.str();
+        unsigned long count = 0;
+        if (text == "message\n")
+            ++written;
+        else if (sscanf(text.c_str(), "VariadicLogger: %lu messages dropped", &count) == 1
+                 && text.find('\n') == text.size() - 1)
+            dropped += count;
+        else if (!text.empty())
+            ++misrouted;
+    }
+
+    unsigned long total = written + dropped;
+    CHECK( misrouted == 0 );
+    CHECK( total == threads * messages );
+}
+
+
+TEST_CASE( "Drop reports of released streams" )
+{
+    SECTION( "shared queue" ) { check_drop_reports(vl::shared_queue); }
+    SECTION( "per thread queues" ) { check_drop_reports(vl::per_thread_queues); }
+}
+
+
+// counts what was written, so it can be checked while the writer is running
+struct CountingBuffer : std::stringbuf
+{
+    CountingBuffer() : written(0) { }
+
+    std::streamsize xsputn(const char* s, std::streamsize n)
+    {
+        std::streamsize result = std::stringbuf::xsputn(s, n);
+        written.fetch_add(static_cast<size_t>(result));
+        return result;
+    }
+
+    std::atomic<size_t> written;
+};
+
+
+TEST_CASE( "Writer per sink" )
+{
+    StallingBuffer slow_sink;
+    CountingBuffer fast_sink;
+    std::stringstream* copy_output = new std::stringstream;
+
+    vl::Logger slow("slow");
+    slow.set_pattern("%v");
+    slow.add_stream(new std::ostream(&slow_sink), vl::debug);
+
+    // the same message goes to both streams
+    vl::Logger fast("fast");
+    fast.set_pattern("%v");
+    fast.set(vl::deferred);
+    fast.add_stream(new std::ostream(&fast_sink), vl::debug);
+    fast.add_stream(copy_output, vl::debug);
+
+    vl::QueueLimits limits;
+    limits.max_messages = 200;
+    auto lm = std::unique_ptr<vl::LogManager>(
+        new vl::LogManager(vl::shared_queue, limits, vl::writer_per_sink));
+
+    slow.log(vl::debug, "0");
+    while (!slow_sink.entered.load())
+        std::this_thread::yield();
+
+    // a stalled stream holds up neither the other streams nor, with room in the queue, the producers
+    std::string expected;
+    for (int i = 0; i < 100; ++i)
+    {
+        fast.log(vl::info, VL_FMT("message {0}"), i);
+        expected += vl::safe_sprintf_ret("message {0}\n", i);
+    }
+
+    for (int i = 0; i < 500 && fast_sink.written.load() < expected.size(); ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CHECK( fast_sink.written.load() == expected.size() );
+
+    slow.log(vl::debug, "1");
+    slow_sink.stalled.store(false);
+    lm.reset();
+
+    CHECK( slow_sink.str() == "0\n1\n" );
+    CHECK( fast_sink.str() == expected );
+    CHECK( copy_output->str() == expected );
+}
+
+
+// output stream telling when it is destroyed
+struct WatchedStream : std::ostringstream
+{
+    explicit WatchedStream(std::atomic<bool>* d) : destroyed(d) { }
+    ~WatchedStream() { destroyed->store(true); }
+
+    std::atomic<bool>* destroyed;
+};
+
+
+TEST_CASE( "Sink registry" )
+{
+    auto lm = std::unique_ptr<vl::LogManager>(new vl::LogManager);
+
+    // loggers with their own streams, then with a stream added, then copied
+    std::vector<vl::Logger> loggers;
+    std::vector<std::stringstream*> outputs;
+    for (int i = 0; i < 20; ++i)
+    {
+        vl::Logger l(vl::safe_sprintf_ret("logger{0}", i));
+        l.set_pattern("%n %v");
+        outputs.push_back(new std::stringstream);
+        l.add_stream(outputs.back(), vl::debug);
+        loggers.push_back(l);
+    }
+
+    for (int i = 0; i < 20; ++i)
+        loggers[i].log(vl::info, "first");
+
+    std::stringstream* shared_output = new std::stringstream;
+    loggers[0].add_stream(shared_output, vl::debug);
+    vl::Logger copy = loggers[0];
+
+    loggers[0].log(vl::info, "second");
+    copy.log(vl::info, "copy");
+
+    // streams of destroyed loggers are released once their messages are written
+    std::atomic<bool> destroyed(false);
+    {
+        vl::Logger l("temporary");
+        l.add_stream(new WatchedStream(&destroyed), vl::debug);
+        l.log(vl::info, "temporary");
+    }
+
+    for (int i = 0; i < 200 && !destroyed.load(); ++i)
+    {
+        loggers[1].log(vl::debug, "wake");
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    CHECK( destroyed.load() );
+
+    lm.reset();
+
+    CHECK( outputs[0]->str() == "logger0 first\nlogger0 second\nlogger0 copy\n" );
+    CHECK( shared_output->str() == "logger0 second\nlogger0 copy\n" );
+    for (int i = 2; i < 20; ++i)
+        CHECK( outputs[i]->str() == vl::safe_sprintf_ret("logger{0} first\n", i) );
+
+    // registered again with a new LogManager
+    lm.reset(new vl::LogManager);
+    loggers[2].log(vl::info, "again");
+    lm.reset();
+    CHECK( outputs[2]->str() == "logger2 first\nlogger2 again\n" );
+}
+
+
+TEST_CASE( "Replacing streams while logging" )
+{
+    vl::QueueMode mode = vl::shared_queue;
+    SECTION( "shared queue" ) { }
+    SECTION( "per thread queues" ) { mode = vl::per_thread_queues; }
+
+    auto lm = std::unique_ptr<vl::LogManager>(new vl::LogManager(mode));
+
+    std::stringbuf worker_output;
+    std::stringbuf replaced_output;
+
+    vl::Logger l("replaced");
+    l.set_pattern("%v");
+    l.add_stream(new std::ostream(&worker_output), vl::debug);
+
+    // copies share the streams, so the worker's set stays registered while
+    // the sets replaced below are released and their slots reused
+    const int threads = 4;
+    const int messages = 2000;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t)
+    {
+        workers.push_back(std::thread([l]() mutable {
+            for (int i = 0; i < messages; ++i)
+                l.log(vl::info, "worker");
+        }));
+    }
+
+    const int replacements = 500;
+    vl::Logger replacing = l;
+    for (int i = 0; i < replacements; ++i)
+    {
+        replacing.clear_streams();
+        replacing.add_stream(new std::ostream(&replaced_output), vl::debug);
+        replacing.log(vl::info, "replacing");
+    }
+
+    for (std::thread& worker : workers)
+        worker.join();
+    lm.reset();
+
+    std::string expected_workers;
+    for (int i = 0; i < threads * messages; ++i)
+        expected_workers += "worker\n";
+    std::string expected_replaced;
+    for (int i = 0; i < replacements; ++i)
+        expected_replaced += "replacing\n";
+
+    CHECK( worker_output.str() == expected_workers );
+    CHECK( replaced_output.str() == expected_replaced );
+}
+
+
+TEST_CASE( "Batched writes" )
+{
+    StallingBuffer sink;
+
+    vl::Logger l("default");
+    l.set(vl::notimestamp);
+    l.set(vl::nothreadid);
+    l.set(vl::nologgername);
+    l.set(vl::nologlevel);
+    l.add_stream(new std::ostream(&sink), vl::debug);
+
+    auto lm = std::unique_ptr<vl::LogManager>(new vl::LogManager);
+
+    // messages queued while the writer waits on the first one are written together
+    l.log(vl::debug, "0");
+    while (!sink.entered.load())
+        std::this_thread::yield();
+
+    std::string expected = "0\n";
+    for (int i = 1; i <= 1000; ++i)
+    {
+        l.log(vl::debug, "{0}", i);
+        expected += vl::safe_sprintf_ret("{0}\n", i);
+    }
+
+    sink.stalled.store(false);
+    lm.reset();
+
+    CHECK( sink.str() == expected );
+    CHECK( sink.writes <= 3 );
+    CHECK( sink.flushes <= 3 );
+}
+
+
+// allocations made by all threads of the test program
+std::atomic<size_t> allocation_count(0);
+
+void* operator new(std::size_t size)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+
+    if (void* p = malloc(size != 0 ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+// gcc warns about free() wherever it inlines this into a delete expression
+#if defined(__GNUC__) && __GNUC__ >= 11
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void* p) throw()
+{
+    free(p);
+}
+
+#if defined(__GNUC__) && __GNUC__ >= 11
+    #pragma GCC diagnostic pop
+#endif
+
+
+// sink that counts the lines written to it and throws them away,
+// the writer waits in it while it is stalled
+struct DiscardingBuffer : std::streambuf
+{
+    DiscardingBuffer() : stalled(false), lines(0) { }
+
+    std::streamsize xsputn(const char* s, std::streamsize n)
+    {
+        while (stalled.load())
+            std::this_thread::yield();
+
+        lines.fetch_add(static_cast<size_t>(std::count(s, s + n, '\n')));
+        return n;
+    }
+
+    int overflow(int c)
+    {
+        if (c == '\n')
+            lines.fetch_add(1);
+        return c;
+    }
+
+    std::atomic<bool> stalled;
+    std::atomic<size_t> lines;
+};
+
+
+TEST_CASE( "Recycled messages" )
+{
+    DiscardingBuffer sink;
+
+    vl::Logger l("recycled");
+    l.add_stream(new std::ostream(&sink), vl::debug);
+
+    vl::QueueMode mode = vl::shared_queue;
+    vl::WriterMode writers = vl::single_writer;
+    SECTION( "shared queue" ) { }
+    SECTION( "per thread queues" ) { mode = vl::per_thread_queues; }
+    SECTION( "deferred formatting" ) { l.set(vl::deferred); }
+    SECTION( "writer per sink" ) { writers = vl::writer_per_sink; }
+
+    auto lm = std::unique_ptr<vl::LogManager>(new vl::LogManager(mode, vl::QueueLimits(), writers));
+
+    size_t logged = 0;
+    auto log_messages = [&](int count) {
+        for (int i = 0; i < count; ++i)
+            l.log(vl::info, VL_FMT("message {0} of {1}: {2:.2f}"), i, "recycled", i * 0.5);
+        logged += count;
+    };
+    auto wait_written = [&]() {
+        for (int i = 0; i < 1000 && sink.lines.load() < logged; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    };
+
+    // the stalled writer lets the messages pile up, so that more of them
+    // circulate and its batch grows bigger than later
+    sink.stalled.store(true);
+    log_messages(1000);
+    sink.stalled.store(false);
+    wait_written();
+
+    log_messages(500);
+    wait_written();
+
+    size_t before = allocation_count.load();
+    log_messages(500);
+    wait_written();
+    size_t allocations = allocation_count.load() - before;
+
+    // a sink's lane still allocates a queue node per message
+    size_t expected = writers == vl::writer_per_sink ? 500 : 0;
+    CHECK( sink.lines.load() == logged );
+    CHECK( allocations <= expected );
+}
+
+
+TEST_CASE( "safe_sprintf static format")
+{
+    std::string out;
+    int value = 42;
+
+    vl::safe_sprintf(out, VL_FMT("{0} {1} {0}"), "abc", value);
+    CHECK( out == "abc 42 abc" );
+
+    out.clear();
+    vl::safe_sprintf(out, VL_FMT("{1:#x} {0:>5} {1:+}"), "ab", value);
+    CHECK( out == "0x2a    ab +42" );
+
+    out.clear();
+    vl::safe_sprintf(out, VL_FMT("{{{0}}} }"), value);
+    CHECK( out == "{42} }" );
+
+    // runtime formats leave anchors without an argument as is, VL_FMT ones do not compile
+    CHECK( vl::safe_sprintf_ret("{0} {2:x}", value) == "42 {2:x}" );
+
+    auto missing = VL_FMT("{0} {2:x}");
+    auto precise_int = VL_FMT("{0:.3} {1:.3}");
+    auto hex_float = VL_FMT("{0:x}");
+    auto char_specs = VL_FMT("{0:x} {0:5} {0:.1}");
+    CHECK_FALSE(( vl::d_::StaticFormatCheck<decltype(missing), int>::anchors_valid ));
+    CHECK(( vl::d_::StaticFormatCheck<decltype(missing), int, int, int>::anchors_valid ));
+    CHECK_FALSE(( vl::d_::StaticFormatCheck<decltype(precise_int), double, int>::specs_valid ));
+    CHECK(( vl::d_::StaticFormatCheck<decltype(precise_int), double, std::string>::specs_valid ));
+    CHECK_FALSE(( vl::d_::StaticFormatCheck<decltype(hex_float), float>::specs_valid ));
+    CHECK(( vl::d_::StaticFormatCheck<decltype(hex_float), long>::specs_valid ));
+    CHECK(( vl::d_::StaticFormatCheck<decltype(char_specs), char>::specs_valid ));
+
+    CHECK( vl::safe_sprintf_ret(VL_FMT("no anchors")) == "no anchors" );
+    CHECK( vl::safe_sprintf_ret(VL_FMT("")) == "" );
+}
+
+
+TEST_CASE( "safe_sprintf escaped braces")
+{
+    std::string out;
+
+    vl::safe_sprintf(out, "{{{0}}} }", 42);
+    CHECK( out == "{42} }" );
+}
+
+
+TEST_CASE( "safe_sprintf long static text" )
+{
+    // braces at every offset within and across vector-sized blocks
+    for (size_t offset = 0; offset < 70; ++offset)
+    {
+        std::string text(offset, 'a');
+        std::string fmt = text + "{0}" + text + "}}" + text + "{{";
+        CHECK( vl::safe_sprintf_ret(fmt, 1) == text + "1" + text + "}" + text + "{" );
+    }
+}
+
+TEST_CASE( "safe_sprintf many arguments" )
+{
+    std::string out;
+    std::string user = "root";
+
+    vl::safe_sprintf(out, "{7} {6} {5} {4} {3} {2} {1} {0} {7}", 0, 1, 2, 3, "4", 5.5, user, 'x');
+    CHECK( out == "x root 5.5 4 3 2 1 0 x" );
+
+    out.clear();
+    vl::safe_sprintf(out, VL_FMT("{7} {6} {5} {4} {3} {2} {1} {0} {8}"), 0, 1, 2, 3, "4", 5.5, user, 'x', 8);
+    CHECK( out == "x root 5.5 4 3 2 1 0 8" );
+}
+
+
+TEST_CASE( "format cache" )
+{
+    vl::clear_format_cache();
+
+    std::string fmt = "cached {0}";
+    for (int i = 0; i < 3; ++i)
+        CHECK( vl::safe_sprintf_ret(fmt, i) == "cached " + std::to_string(i) );
+
+    vl::FormatCacheStats stats = vl::format_cache_stats();
+    CHECK( stats.misses == 1 );
+    CHECK( stats.hits == 2 );
+    CHECK( stats.size == 1 );
+
+    // looked up by the address of the text, a buffer reused for another string is parsed again
+    std::string reused = "first {0}";
+    CHECK( vl::safe_sprintf_ret(reused, 1) == "first 1" );
+    const char* data = reused.data();
+    reused.replace(0, 5, "{0}th");
+    REQUIRE( reused.data() == data );
+    CHECK( vl::safe_sprintf_ret(reused, 1) == "1th 1" );
+
+    size_t capacity = stats.capacity;
+    vl::set_format_cache_capacity(0);
+
+    CHECK( vl::safe_sprintf_ret("not cached {0}", 1) == "not cached 1" );
+    CHECK( vl::format_cache_stats().size == 0 );
+
+    // the capacity asked for is kept, not rounded up to the shards
+    vl::set_format_cache_capacity(1);
+    CHECK( vl::format_cache_stats().capacity == 1 );
+    for (int i = 0; i < 50; ++i)
+        vl::safe_sprintf_ret("distinct " + std::to_string(i) + " {0}", i);
+    CHECK( vl::format_cache_stats().size <= 1 );
+
+    // a format string used all the time is not evicted by ones used once
+    vl::clear_format_cache();
+    vl::set_format_cache_capacity(32);
+    for (int i = 0; i < 200; ++i)
+    {
+        vl::safe_sprintf_ret("hot {0}", i);
+        vl::safe_sprintf_ret("cold " + std::to_string(i) + " {0}", i);
+    }
+    stats = vl::format_cache_stats();
+    CHECK( stats.hits == 199 );
+    CHECK( stats.size <= 32 );
+
+    vl::set_format_cache_capacity(capacity);
+    CHECK( vl::format_cache_stats().capacity == capacity );
+}
+
+
 TEST_CASE( "safe_sprintf hex formatting")
 {
     std::string out;
@@ -319,6 +1494,22 @@ TEST_CASE( "safe_sprintf oct formatting")
 }
 
 
+TEST_CASE( "safe_sprintf integer formatting")
+{
+    CHECK( vl::safe_sprintf_ret("{0:b} {0:#b}", 42) == "101010 0b101010" );
+    CHECK( vl::safe_sprintf_ret("{0:,} {1:,d}", 1234567, -999) == "1,234,567 -999" );
+    CHECK( vl::safe_sprintf_ret("{0:^6}|{0:*^7}", 42) == "  42  |**42***" );
+    CHECK( vl::safe_sprintf_ret("{0: } {1: }", 42, -42) == " 42 -42" );
+    CHECK( vl::safe_sprintf_ret("{0:x} {0:#010x}", -255) == "-ff -0x00000ff" );
+    CHECK( vl::safe_sprintf_ret("{0} {1}", -9223372036854775807ll - 1, 18446744073709551615ull)
+           == "-9223372036854775808 18446744073709551615" );
+    CHECK( vl::safe_sprintf_ret("{0} {1} {2}", true, 'c', static_cast<unsigned char>('u')) == "1 c u" );
+
+    long value = 1024;
+    CHECK( vl::safe_sprintf_ret(VL_FMT("{0:x} {0:o} {0:d}"), value) == "400 2000 1024" );
+}
+
+
 TEST_CASE( "safe_sprintf width + fill + align")
 {
     std::string out;
@@ -444,6 +1635,124 @@ TEST_CASE( "safe_sprintf float formatting and precision")
 }
 
 
+TEST_CASE( "safe_sprintf shortest float formatting" )
+{
+    CHECK( vl::safe_sprintf_ret("{0} {1} {2} {3}", 0.1, 1.0 / 3, 100.0, -0.0) == "0.1 0.3333333333333333 100 -0" );
+    CHECK( vl::safe_sprintf_ret("{0} {1} {2}", 1e16, 1.5e-5, 5e-324) == "1e+16 1.5e-05 5e-324" );
+    CHECK( vl::safe_sprintf_ret("{0}", 0.1f) == "0.1" );
+    CHECK( vl::safe_sprintf_ret("{0:+} {1:08}", 2.5, -2.5) == "+2.5 -00002.5" );
+    CHECK( vl::safe_sprintf_ret("{0:.1%} {1:%}", 0.125, 1.0) == "12.5% 100.000000%" );
+    CHECK( vl::safe_sprintf_ret("{0} {1:F} {2:>5}", 1.0 / 0.0, -1.0 / 0.0, std::nan("")) == "inf -INF   nan" );
+}
+
+
+static bool reads_back(double value)
+{
+    std::string s = vl::safe_sprintf_ret("{0}", value);
+    return strtod(s.c_str(), nullptr) == value;
+}
+
+
+TEST_CASE( "safe_sprintf shortest float round trip" )
+{
+    CHECK( vl::safe_sprintf_ret("{0} {1}", DBL_MIN, DBL_MAX) == "2.2250738585072014e-308 1.7976931348623157e+308" );
+    CHECK( reads_back(std::nextafter(DBL_MIN, 0.0)) );
+    CHECK( reads_back(std::nextafter(DBL_MIN, 1.0)) );
+
+    int failed = 0;
+    for (int e = -1074; e < 1024; ++e)
+    {
+        double power = std::ldexp(1.0, e);
+        if (!reads_back(power) || !reads_back(std::nextafter(power, 0.0)))
+            ++failed;
+    }
+    CHECK( failed == 0 );
+
+    std::mt19937_64 rng(20131016);
+    for (int i = 0; i < 100000; ++i)
+    {
+        uint64_t bits = rng();
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        if (std::isfinite(value) && !reads_back(value))
+            ++failed;
+    }
+    CHECK( failed == 0 );
+}
+
+
+TEST_CASE( "safe_sprintf into buffers" )
+{
+    vl::MemoryBuffer<16> small;
+    vl::safe_sprintf(small, "{0}-{1}", 12, "ab");
+    CHECK( small.str() == "12-ab" );
+
+    vl::safe_sprintf(small, " {0:>20}", 'x');
+    CHECK( small.size() == 26 );
+    CHECK( small.str() == "12-ab                    x" );
+
+    char buf[8];
+    vl::FormatResult r = vl::format_to(buf, sizeof(buf), "{0} {1}", 12345, "abcdef");
+    CHECK( r.size == 8 );
+    CHECK( r.total_size == 12 );
+    CHECK( r.truncated() );
+    CHECK( std::string(buf, r.size) == "12345 ab" );
+
+    std::string out = "log: ";
+    vl::safe_sprintf(out, "{0}", 42);
+    CHECK( out == "log: 42" );
+}
+
+TEST_CASE( "formatted_size" )
+{
+    CHECK( vl::formatted_size("") == 0 );
+    CHECK( vl::formatted_size("{0} of {1:>5}", 12, "abc") == 11 );
+    CHECK( vl::formatted_size(VL_FMT("{0:.3f}"), 1.0) == 5 );
+    CHECK( vl::formatted_size("{0}", std::string(5000, 'x')) == 5000 );
+}
+
+TEST_CASE( "format_to does not allocate" )
+{
+    char buf[64];
+    const char* fmt = "request {0} took {1:.2f} ms for {2}";  // longer than any inline string
+
+    // parsed into the cache
+    vl::format_to(buf, sizeof(buf), fmt, 1, 2.5, "alice");
+    vl::format_to(buf, sizeof(buf), "{0} characters of a literal format string", 1);
+
+    size_t before = allocation_count.load();
+    size_t total = 0;
+    for (int i = 0; i < 100; ++i)
+    {
+        total += vl::format_to(buf, sizeof(buf), fmt, i, i * 0.5, "alice").size;
+        total += vl::formatted_size(fmt, i, i * 0.5, "alice");
+        total += vl::format_to(buf, sizeof(buf), "{0} characters of a literal format string", i).size;
+    }
+    size_t allocations = allocation_count.load() - before;
+
+    CHECK( total > 0 );
+    CHECK( allocations == 0 );
+}
+
+TEST_CASE( "safe_sprintf strings and chars" )
+{
+    const char* null_str = nullptr;
+    CHECK( vl::safe_sprintf_ret("{0:.3}|{1:5}|{2:>5}|{3:^5}", "abcdef", "ab", std::string("ab"), "ab") == "abc|ab   |   ab| ab  " );
+    CHECK( vl::safe_sprintf_ret("{0}", null_str) == "(null)" );
+    CHECK( vl::safe_sprintf_ret("{0} {0:x} {0:>3}", 'a') == "a 61   a" );
+}
+
+struct StreamedRatio
+{
+    double value;
+};
+
+std::ostream& operator<<(std::ostream& os, const StreamedRatio& r)
+{
+    return os << r.value;
+}
+
+
 TEST_CASE( "safe_sprintf precision" )
 {
     std::string out;
@@ -465,6 +1774,10 @@ TEST_CASE( "safe_sprintf precision" )
     out.clear();
     vl::safe_sprintf(out, "{0:.5}", -1.123456);
     CHECK( out == "-1.1235" );
+
+    // types printed through operator<< get it as the stream's precision
+    StreamedRatio third = { 1.0 / 3 };
+    CHECK( vl::safe_sprintf_ret("{0:.2} {0:.4}", third) == "0.33 0.3333" );
 }
 
 